@@ -25,10 +25,11 @@
 #define SECTORSIZE          512
 #define ELFHDR              ((elf_header*) 0x3000) // scratch space
 #define KERNEL_START_SECTOR 1
+#define MAXREADSECTS        128     // sectors per ATA read command
 
 extern "C" {
 [[noreturn]] void boot();
-static void boot_readsect(uintptr_t dst, uint32_t src_sect);
+static void boot_readsect(uintptr_t dst, uint32_t src_sect, uint32_t nsect);
 static void boot_readseg(uintptr_t dst, uint32_t src_sect,
                          size_t filesz, size_t memsz);
 }
@@ -74,9 +75,15 @@ static void boot_readseg(uintptr_t ptr, uint32_t src_sect,
     // round down to sector boundary
     ptr &= ~(SECTORSIZE - 1);
 
-    // read sectors
-    for (; ptr < end_ptr; ptr += SECTORSIZE, ++src_sect) {
-        boot_readsect(ptr, src_sect);
+    // read sectors, up to `MAXREADSECTS` per disk command (the first
+    // command reads the odd-sized remainder, which is cheaper to compute
+    // than a minimum)
+    while (ptr < end_ptr) {
+        uint32_t nsect = (end_ptr - ptr + SECTORSIZE - 1) / SECTORSIZE;
+        nsect = (nsect - 1) % MAXREADSECTS + 1;
+        boot_readsect(ptr, src_sect, nsect);
+        ptr += nsect * SECTORSIZE;
+        src_sect += nsect;
     }
 
     // clear bss segment
@@ -88,7 +95,7 @@ static void boot_readseg(uintptr_t ptr, uint32_t src_sect,
 
 // boot_waitdisk
 //    Wait for the disk to be ready.
-static void boot_waitdisk() {
+__noinline static void boot_waitdisk() {
     // Wait until the ATA status register says ready (0x40 is on)
     // & not busy (0x80 is off)
     while ((inb(0x1F7) & 0xC0) != 0x40) {
@@ -97,19 +104,22 @@ static void boot_waitdisk() {
 }
 
 
-// boot_readsect(dst, src_sect)
-//    Read disk sector number `src_sect` into address `dst`.
-static void boot_readsect(uintptr_t dst, uint32_t src_sect) {
-    // programmed I/O for "read sector"
+// boot_readsect(dst, src_sect, nsect)
+//    Read `nsect` disk sectors, starting at sector number `src_sect`, into
+//    address `dst`. `nsect` must be between 1 and 255.
+static void boot_readsect(uintptr_t dst, uint32_t src_sect, uint32_t nsect) {
+    // programmed I/O for "read sectors"
     boot_waitdisk();
-    outb(0x1F2, 1);             // send `count = 1` as an ATA argument
+    outb(0x1F2, nsect);         // send `count = nsect` as an ATA argument
     outb(0x1F3, src_sect);      // send `src_sect`, the sector number
     outb(0x1F4, src_sect >> 8);
     outb(0x1F5, src_sect >> 16);
     outb(0x1F6, (src_sect >> 24) | 0xE0);
     outb(0x1F7, 0x20);          // send the command: 0x20 = read sectors
 
-    // then move the data into memory
-    boot_waitdisk();
-    insl(0x1F0, (void*) dst, SECTORSIZE/4); // read 128 words from the disk
+    // then move the data into memory as each sector becomes ready
+    for (; nsect != 0; --nsect, dst += SECTORSIZE) {
+        boot_waitdisk();
+        insl(0x1F0, (void*) dst, SECTORSIZE/4); // read 128 words from the disk
+    }
 }
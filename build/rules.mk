@@ -48,7 +48,7 @@ CXXFLAGS := $(CXXFLAGS) $(CCOMMONFLAGS) -std=gnu++1z \
 	-fno-exceptions -fno-rtti -gdwarf -ffunction-sections
 DEPCFLAGS = -MD -MF $(DEPSDIR)/$(@F).d -MP
 
-KERNELCXXFLAGS = $(CXXFLAGS) -mno-red-zone $(SANITIZEFLAGS)
+KERNELCXXFLAGS = $(CXXFLAGS) -mno-red-zone $(KERNELDEFS) $(SANITIZEFLAGS)
 ifeq ($(filter 1,$(SAN) $(UBSAN)),1)
 KERNEL_OBJS += $(OBJDIR)/k-sanitizers.ko
 KERNELCXXFLAGS += -DHAVE_SANITIZERS
@@ -153,7 +153,7 @@ always:
 .PHONY: all always clean realclean distclean cleanfs fsck \
 	run run-graphic run-console run-monitor \
 	run-gdb run-gdb-graphic run-gdb-console run-gdb-report \
-	check-qemu-console check-qemu kill \
+	check-qemu-console check-qemu kill bench bench-run \
 	run-% run-graphic-% run-console-% run-monitor-% \
 	run-gdb-% run-gdb-graphic-% run-gdb-console-%
 
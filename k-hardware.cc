@@ -21,7 +21,7 @@ pcistate pcistate::state;
 static void init_kernel_memory();
 static void init_interrupts();
 static void init_constructors();
-static void init_cpu_hardware();
+static void init_cpu_hardware(cpustate* c);
 static void stash_kernel_data(bool restore);
 
 void init_hardware() {
@@ -39,7 +39,9 @@ void init_hardware() {
     init_constructors();
 
     // initialize this CPU
-    init_cpu_hardware();
+    cpus[0].index = 0;
+    cpus[0].kstack_top = KERNEL_STACK_TOP;
+    init_cpu_hardware(&cpus[0]);
 }
 
 
@@ -89,6 +91,7 @@ static void set_gate(x86_64_gatedescriptor* gate, uintptr_t addr,
 
 x86_64_pagetable kernel_pagetable[5];
 static uint64_t gdt_segments[7];
+uint64_t cr3_noflush;
 
 void init_kernel_memory() {
     stash_kernel_data(false);
@@ -119,12 +122,12 @@ void init_kernel_memory() {
 
     // the kernel can access [1GiB,4GiB) of physical memory,
     // which includes important memory-mapped I/O devices
-    kernel_pagetable[1].entry[1] =
-        (1UL << 30) | PTE_P | PTE_W | PTE_PS;
-    kernel_pagetable[1].entry[2] =
-        (2UL << 30) | PTE_P | PTE_W | PTE_PS;
-    kernel_pagetable[1].entry[3] =
-        (3UL << 30) | PTE_P | PTE_W | PTE_PS;
+    // (1 GiB pages need no page table pages, so this cannot fail)
+    for (vmiter it(kernel_pagetable, 1UL << 30);
+         it.va() < (4UL << 30);
+         it += 1UL << 30) {
+        it.map(it.va(), PTE_P | PTE_W, 2);
+    }
 
     // user-accessible mappings for physical memory,
     // except that (for debuggability) nullptr is totally inaccessible
@@ -144,6 +147,104 @@ void init_kernel_memory() {
 }
 
 
+// init_other_cpus
+//    Application processors start in real mode at a page-aligned address
+//    below 1 MiB. `ap_entry` in k-exception.S gets them into 64-bit mode,
+//    then each one claims an index and calls `ap_start` on the kernel
+//    stack `ap_stack_tops[index]`.
+
+cpustate cpus[MAXCPU];
+std::atomic<int> ncpu;
+extern "C" {
+int ap_next_index = 1;
+uintptr_t ap_stack_tops[MAXCPU];
+}
+extern char ap_entry[], ap_entry_end[];
+
+void ap_start(int index) {
+    cpustate* c = &cpus[index];
+    c->index = index;
+    c->kstack_top = ap_stack_tops[index];
+    c->lapic_id = lapicstate::get().id();
+    init_cpu_hardware(c);
+    ++ncpu;
+    ap_kernel_start();
+}
+
+static void delay_us(unsigned n) {
+    // time the wait with the LAPIC timer, which counts at 1 GHz (see
+    // `init_timer`); interrupts are off, and the timer is stopped again
+    // long before it could fire
+    init_timer_oneshot(0xFFFFFFFFU);
+    uint32_t c0 = timer_remaining();
+    while (c0 - timer_remaining() < n * 1000) {
+        pause();
+    }
+    init_timer_oneshot(0);
+}
+
+void init_other_cpus() {
+    cpus[0].lapic_id = lapicstate::get().id();
+    ncpu = 1;
+    ap_next_index = 1;
+
+    // copy the trampoline to a low page; this allocation happens before
+    // any process exists, so it gets one of the lowest free pages
+    void* trampoline = kalloc(PAGESIZE);
+    if (!trampoline || kptr2pa(trampoline) >= 0x100000) {
+        kfree(trampoline);
+        return;
+    }
+    memcpy(trampoline, ap_entry, ap_entry_end - ap_entry);
+
+    // allocate a kernel stack page for every slot; it must lie below
+    // PROC_START_ADDR, where process page tables map kernel memory
+    for (int i = 1; i != MAXCPU; ++i) {
+        void* stack = kalloc(PAGESIZE);
+        if (!stack || kptr2pa(stack) + PAGESIZE > PROC_START_ADDR) {
+            kfree(stack);
+            break;
+        }
+        ap_stack_tops[i] = kptr2pa(stack) + PAGESIZE;
+    }
+
+    // INIT, wait 10ms, then two STARTUPs 200us apart (Intel SDM 8.4.4.1)
+    auto& lapic = lapicstate::get();
+    lapic.ipi_others(lapic.ipi_init);
+    while (lapic.ipi_pending()) {
+        pause();
+    }
+    delay_us(10000);
+    for (int i = 0; i != 2; ++i) {
+        lapic.ipi_others(lapic.ipi_startup, kptr2pa(trampoline) >> 12);
+        while (lapic.ipi_pending()) {
+            pause();
+        }
+        delay_us(200);
+    }
+
+    // give the processors time to check in, then stop handing out slots
+    // and free the unclaimed stacks. If any processor checked in, the
+    // trampoline page stays allocated in case another is still running
+    // it; if none did, this machine has a single CPU.
+    delay_us(10000);
+    int nclaimed = __atomic_exchange_n(&ap_next_index, MAXCPU,
+                                       __ATOMIC_ACQ_REL);
+    for (int i = max(nclaimed, 1); i < MAXCPU; ++i) {
+        if (ap_stack_tops[i]) {
+            kfree(reinterpret_cast<void*>(ap_stack_tops[i] - PAGESIZE));
+            ap_stack_tops[i] = 0;
+        }
+    }
+    if (nclaimed == 1) {
+        kfree(trampoline);
+    }
+    if (ncpu > 1) {
+        log_printf("%d CPUs online\n", ncpu.load());
+    }
+}
+
+
 // init_interrupts
 
 // processor state for taking an interrupt
@@ -177,6 +278,11 @@ void init_interrupts() {
 #define IO_PIC2         0xA0    // Slave (IRQs 8-15)
     outb(IO_PIC1 + 1, 0xFF);
     outb(IO_PIC2 + 1, 0xFF);
+
+    // deliver keyboard interrupts to this CPU, so an idle kernel can
+    // halt rather than poll for Control-C
+    ioapic.enable_irq(IRQ_KEYBOARD, INT_IRQ + IRQ_KEYBOARD,
+                      lapicstate::get().id());
 }
 
 
@@ -190,30 +296,33 @@ void init_constructors() {
 }
 
 
-static x86_64_taskstate taskstate;
+// init_cpu_hardware(c)
+//    Set up the CPU described by `c`, whose `kstack_top` must be set. Each
+//    CPU has its own GDT, since `ltr` marks a task state descriptor busy.
 
-void init_cpu_hardware() {
+void init_cpu_hardware(cpustate* c) {
     // initialize per-CPU segments
-    gdt_segments[0] = 0;
-    set_app_segment(&gdt_segments[SEGSEL_KERN_CODE >> 3],
+    uint64_t* segments = c->gdt_segments;
+    segments[0] = 0;
+    set_app_segment(&segments[SEGSEL_KERN_CODE >> 3],
                     X86SEG_X | X86SEG_L, 0);
-    set_app_segment(&gdt_segments[SEGSEL_KERN_DATA >> 3],
+    set_app_segment(&segments[SEGSEL_KERN_DATA >> 3],
                     X86SEG_W, 0);
-    set_app_segment(&gdt_segments[SEGSEL_APP_CODE >> 3],
+    set_app_segment(&segments[SEGSEL_APP_CODE >> 3],
                     X86SEG_X | X86SEG_L, 3);
-    set_app_segment(&gdt_segments[SEGSEL_APP_DATA >> 3],
+    set_app_segment(&segments[SEGSEL_APP_DATA >> 3],
                     X86SEG_W, 3);
-    set_sys_segment(&gdt_segments[SEGSEL_TASKSTATE >> 3],
-                    (uintptr_t) &taskstate, sizeof(taskstate),
+    set_sys_segment(&segments[SEGSEL_TASKSTATE >> 3],
+                    (uintptr_t) &c->taskstate, sizeof(c->taskstate),
                     X86SEG_TSS, 0);
 
     // taskstate lets the kernel receive interrupts
-    memset(&taskstate, 0, sizeof(taskstate));
-    taskstate.ts_rsp[0] = KERNEL_STACK_TOP;
+    memset(&c->taskstate, 0, sizeof(c->taskstate));
+    c->taskstate.ts_rsp[0] = c->kstack_top;
 
     x86_64_pseudodescriptor gdt, idt;
-    gdt.limit = sizeof(gdt_segments) - 1;
-    gdt.base = (uint64_t) gdt_segments;
+    gdt.limit = sizeof(c->gdt_segments) - 1;
+    gdt.base = (uint64_t) segments;
     idt.limit = sizeof(interrupt_descriptors) - 1;
     idt.base = (uint64_t) interrupt_descriptors;
 
@@ -225,9 +334,11 @@ void init_cpu_hardware() {
                    "m" (idt.limit)
                  : "memory", "cc");
 
-    // initialize segments
+    // initialize segments; `swapgs` in `syscall_entry` exchanges the
+    // zero %gs base with `c`
     asm volatile("movw %%ax, %%fs; movw %%ax, %%gs"
                  : : "a" ((uint16_t) SEGSEL_KERN_DATA));
+    wrmsr(MSR_IA32_KERNEL_GS_BASE, reinterpret_cast<uint64_t>(c));
 
 
     // set up control registers
@@ -236,9 +347,19 @@ void init_cpu_hardware() {
     wrcr0(cr0);
 
 
+    // enable process-context identifiers if the CPU supports them, so
+    // switching page tables need not flush the TLB (see `process_cr3`)
+    if (cpuid(1).ecx & (1U << 17)) {
+        wrcr4(rdcr4() | CR4_PCIDE);
+        cr3_noflush = CR3_NOFLUSH;
+    }
+
+
     // set up syscall/sysret
+    // (`sysretq` loads %ss from STAR[63:48] + 8 and %cs from
+    // STAR[63:48] + 16)
     wrmsr(MSR_IA32_STAR, (uintptr_t(SEGSEL_KERN_CODE) << 32)
-          | (uintptr_t(SEGSEL_APP_CODE) << 48));
+          | (uintptr_t(SEGSEL_APP_DATA - 8) << 48));
     wrmsr(MSR_IA32_LSTAR, reinterpret_cast<uint64_t>(syscall_entry));
     wrmsr(MSR_IA32_FMASK, EFLAGS_TF | EFLAGS_DF | EFLAGS_IF
           | EFLAGS_IOPL_MASK | EFLAGS_AC | EFLAGS_NT);
@@ -274,6 +395,8 @@ void init_cpu_hardware() {
 
 void init_timer(int rate) {
     auto& lapic = lapicstate::get();
+    lapic.write(lapic.reg_lvt_timer,
+                lapic.timer_periodic | (INT_IRQ + IRQ_TIMER));
     if (rate > 0) {
         lapic.write(lapic.reg_timer_initial_count, 1000000000 / rate);
     } else {
@@ -281,16 +404,42 @@ void init_timer(int rate) {
     }
 }
 
+// init_timer_oneshot(count)
+//    Set the timer interrupt to fire once, `count` timer cycles from now.
+void init_timer_oneshot(uint32_t count) {
+    auto& lapic = lapicstate::get();
+    lapic.write(lapic.reg_lvt_timer, INT_IRQ + IRQ_TIMER);
+    lapic.write(lapic.reg_timer_initial_count, count);
+}
+
+// timer_remaining()
+//    Return the number of timer cycles left before the timer fires.
+uint32_t timer_remaining() {
+    auto& lapic = lapicstate::get();
+    return lapic.read(lapic.reg_timer_current_count);
+}
+
+// measure_tsc_hz()
+//    Return the TSC frequency in Hz, timing 10ms of timer cycles.
+uint64_t measure_tsc_hz() {
+    init_timer_oneshot(0xFFFFFFFFU);
+    uint32_t c0 = timer_remaining();
+    uint64_t t0 = rdtsc();
+    uint32_t c1;
+    do {
+        c1 = timer_remaining();
+    } while (c0 - c1 < 10000000);
+    uint64_t t1 = rdtsc();
+    init_timer_oneshot(0);
+    return (t1 - t0) * 1000000000 / (c0 - c1);
+}
+
 
 // kalloc_pagetable
 //    Allocate and return a new, empty page table.
 
 x86_64_pagetable* kalloc_pagetable() {
-    x86_64_pagetable* pt = reinterpret_cast<x86_64_pagetable*>(kalloc(PAGESIZE));
-    if (pt) {
-        memset(&pt->entry[0], 0, sizeof(x86_64_pageentry_t) * 512);
-    }
-    return pt;
+    return reinterpret_cast<x86_64_pagetable*>(kalloc_zeroed());
 }
 
 
@@ -377,6 +526,7 @@ void pcistate::enable(int addr) {
 //    that speaks ACPI.
 
 void poweroff() {
+    log_flush();
     auto& pci = pcistate::get();
     int addr = pci.find([&] (int a) {
             uint32_t vd = pci.readl(a + pci.config_vendor);
@@ -400,6 +550,7 @@ void poweroff() {
 //    Reboot the virtual machine.
 
 void reboot() {
+    log_flush();
     outb(0x92, 3); // does not return
     while (true) {
     }
@@ -431,9 +582,16 @@ void init_process(proc* p, int flags) {
 //    and 80 * 25.
 
 void console_show_cursor(int cpos) {
+    // every trap calls this; skip the slow CRT port writes when the
+    // cursor has not moved
+    static int shown_cpos = -1;
     if (cpos < 0 || cpos > CONSOLE_ROWS * CONSOLE_COLUMNS) {
         cpos = 0;
     }
+    if (cpos == shown_cpos) {
+        return;
+    }
+    shown_cpos = cpos;
     outb(0x3D4, 14);
     outb(0x3D5, cpos / 256);
     outb(0x3D4, 15);
@@ -554,9 +712,11 @@ int keyboard_readc() {
 }
 
 
-// log_printf, log_vprintf
+// log_printf, log_vprintf, log_flush
 //    Print debugging messages to the host's `log.txt` file. We run QEMU
 //    so that messages written to the QEMU "parallel port" end up in `log.txt`.
+//    Each byte costs several port I/Os, so messages are first appended to
+//    `logbuf`, then written out in bulk by `log_flush`.
 
 #define IO_PARALLEL1_DATA       0x378
 #define IO_PARALLEL1_STATUS     0x379
@@ -592,10 +752,41 @@ static void parallel_port_putc(unsigned char c) {
          | IO_PARALLEL_CONTROL_INIT);
 }
 
+#define LOGBUF_SIZE 8192
+static char logbuf[LOGBUF_SIZE];
+static size_t logbuf_head;      // index of next byte to write to the port
+static size_t logbuf_tail;      // index of next byte to append
+
+void log_flush() {
+    while (logbuf_head != logbuf_tail) {
+        parallel_port_putc(logbuf[logbuf_head % LOGBUF_SIZE]);
+        ++logbuf_head;
+    }
+}
+
 namespace {
 struct log_printer : public printer {
     void putc(unsigned char c, int) override {
-        parallel_port_putc(c);
+        if (logbuf_tail - logbuf_head == LOGBUF_SIZE) {
+            log_flush();
+        }
+        logbuf[logbuf_tail % LOGBUF_SIZE] = c;
+        ++logbuf_tail;
+    }
+    void write(const char* s, size_t len, int) override {
+        while (len > 0) {
+            if (logbuf_tail - logbuf_head == LOGBUF_SIZE) {
+                log_flush();
+            }
+            // copy up to the end of the ring or of the free space
+            size_t off = logbuf_tail % LOGBUF_SIZE;
+            size_t n = min(len, LOGBUF_SIZE - off,
+                           LOGBUF_SIZE - (logbuf_tail - logbuf_head));
+            memcpy(&logbuf[off], s, n);
+            logbuf_tail += n;
+            s += n;
+            len -= n;
+        }
     }
 };
 }
@@ -742,16 +933,29 @@ int error_vprintf(int cpos, int color, const char* format, va_list val) {
 
 
 // check_keyboard
-//    Check for the user typing a control key. 'a', 'f', and 'e' cause a soft
-//    reboot where the kernel runs the allocator programs, "fork", or
-//    "forkexit", respectively. Control-C or 'q' exit the virtual machine.
-//    Returns key typed or -1 for no key.
+//    Check for the user typing a control key. 'a', 'f', 'e', 'm', and 'b'
+//    cause a soft reboot where the kernel runs the allocator programs,
+//    "fork", "forkexit", "membench", or "bench", respectively; only the
+//    boot CPU reboots. Control-C or 'q' exit the virtual machine. In
+//    profiling kernels, 'p' logs the profile. Returns key typed or -1 for
+//    no key.
 
 int check_keyboard() {
     int c = keyboard_readc();
-    if (c == 'a' || c == 'f' || c == 'e') {
+    if ((c == 'a' || c == 'f' || c == 'e' || c == 'm' || c == 'b')
+        && this_cpu() == &cpus[0]) {
+        // Stop the other CPUs; the new kernel starts them again.
+        if (ncpu > 1) {
+            auto& lapic = lapicstate::get();
+            lapic.ipi_others(lapic.ipi_init);
+            while (lapic.ipi_pending()) {
+                pause();
+            }
+        }
         // Turn off the timer interrupt.
         init_timer(-1);
+        // Write out buffered log messages; `logbuf` is about to be cleared.
+        log_flush();
         // Install a temporary page table to carry us through the
         // process of reinitializing memory. This replicates work the
         // bootloader does.
@@ -770,6 +974,10 @@ int check_keyboard() {
             argument = "allocators";
         } else if (c == 'e') {
             argument = "forkexit";
+        } else if (c == 'm') {
+            argument = "membench";
+        } else if (c == 'b') {
+            argument = "bench";
         }
         uintptr_t argument_ptr = (uintptr_t) argument;
         assert(argument_ptr < 0x100000000L);
@@ -787,6 +995,10 @@ int check_keyboard() {
                      : : "b" (multiboot_info) : "memory");
     } else if (c == 0x03 || c == 'q') {
         poweroff();
+#if WEENSYOS_PROFILE
+    } else if (c == 'p') {
+        profile_dump();
+#endif
     }
     return c;
 }
@@ -796,6 +1008,7 @@ int check_keyboard() {
 //    Loop until user presses Control-C, then poweroff.
 
 [[noreturn]] void fail() {
+    log_flush();
     while (true) {
         check_keyboard();
     }
@@ -937,9 +1150,46 @@ int program_image::program_number(const char* program_name) {
 program_image::program_image(const char* program_name)
     : program_image(program_number(program_name)) {
 }
+const char* program_image::program_name(int program_number) {
+    if (program_number >= 0
+        && size_t(program_number) < sizeof(ramimages) / sizeof(ramimages[0])) {
+        return ramimages[program_number].name;
+    }
+    return nullptr;
+}
 uintptr_t program_image::entry() const {
     return elf_ ? elf_->e_entry : 0;
 }
+bool program_image::lookup_symbol(uintptr_t addr, const char** name,
+                                  uintptr_t* start) const {
+    if (!elf_ || !elf_->e_shoff) {
+        return false;
+    }
+    auto base = reinterpret_cast<const char*>(elf_);
+    auto sh = reinterpret_cast<const elf_section*>(base + elf_->e_shoff);
+    for (unsigned i = 0; i != elf_->e_shnum; ++i) {
+        if (sh[i].sh_type != ELF_SHT_SYMTAB || sh[i].sh_link >= elf_->e_shnum) {
+            continue;
+        }
+        auto sym = reinterpret_cast<const elf_symbol*>(base + sh[i].sh_offset);
+        size_t nsym = sh[i].sh_size / sizeof(elf_symbol);
+        const char* strtab = base + sh[sh[i].sh_link].sh_offset;
+        for (size_t j = 0; j != nsym; ++j) {
+            if ((sym[j].st_info & ELF_STT_MASK) == ELF_STT_FUNC
+                && sym[j].st_value <= addr
+                && addr < sym[j].st_value + sym[j].st_size) {
+                if (name) {
+                    *name = strtab + sym[j].st_name;
+                }
+                if (start) {
+                    *start = sym[j].st_value;
+                }
+                return true;
+            }
+        }
+    }
+    return false;
+}
 bool program_image::empty() const {
     return !elf_ || elf_->e_phnum == 0;
 }
@@ -1073,5 +1323,17 @@ static void stash_kernel_data(bool reboot) {
 
 // `proc` members have fixed offsets
 static_assert(offsetof(proc, pagetable) == 0, "proc::pagetable has bad offset");
+static_assert(offsetof(proc, pid) == 8, "proc::pid has bad offset");
 static_assert(offsetof(proc, state) == 12, "proc::state has bad offset");
 static_assert(offsetof(proc, regs) == 16, "proc::refs has bad offset");
+static_assert(offsetof(cpustate, kstack_top) == CPUSTATE_KSTACK_TOP,
+              "cpustate::kstack_top has bad offset");
+static_assert(offsetof(cpustate, user_rsp) == CPUSTATE_USER_RSP,
+              "cpustate::user_rsp has bad offset");
+static_assert(offsetof(cpustate, current_pid) == CPUSTATE_CURRENT_PID,
+              "cpustate::current_pid has bad offset");
+static_assert(sizeof(regstate) == 8 * 24,
+              "exception_return copies 24 words of regstate");
+static_assert(NPROC <= CR3_PCIDMASK + 1, "pids must fit in a PCID");
+static_assert(SEGSEL_APP_CODE == SEGSEL_APP_DATA + 8,
+              "sysretq needs SEGSEL_APP_CODE right after SEGSEL_APP_DATA");
@@ -80,11 +80,19 @@ void memusage::refresh() {
     }
     mark(kptr2pa(kernel_pagetable), f_kernel);
 
+    // mark the application processors' kernel stacks
+    for (int i = 1; i != MAXCPU; ++i) {
+        if (cpus[i].kstack_top) {
+            mark(cpus[i].kstack_top - PAGESIZE, f_kernel);
+        }
+    }
+
     // mark pages accessible from each process's page table
     bool any = false;
     for (int pid = 1; pid < NPROC; ++pid) {
-        proc* p = &ptable[pid];
-        if (p->state != P_FREE
+        proc* p = ptable[pid];
+        if (p
+            && p->state != P_FREE
             && p->pagetable
             && p->pagetable != kernel_pagetable) {
             any = true;
@@ -93,6 +101,7 @@ void memusage::refresh() {
                 mark(it.pa(), f_kernel | f_process(pid));
             }
             mark(kptr2pa(p->pagetable), f_kernel | f_process(pid));
+            mark(kptr2pa(p), f_kernel | f_process(pid));
 
             for (vmiter it(p); it.va() < VA_LOWEND; ) {
                 if (it.user()) {
@@ -235,7 +244,7 @@ static void console_memviewer_virtual(memusage& mu, proc* vmp) {
 
 void console_memviewer(proc* vmp) {
     // Process 0 must never be used.
-    assert(ptable[0].state == P_FREE);
+    assert(!ptable[0]);
 
     // track physical memory
     static memusage mu;
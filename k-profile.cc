@@ -0,0 +1,102 @@
+#include "kernel.hh"
+
+// k-profile.cc
+//
+//    Sampling profiler, built with `make PROFILE=1`. Every timer interrupt
+//    records the interrupted %rip, and the process and program it belongs
+//    to, in a ring of recent samples. Typing 'p' logs a histogram of the
+//    hottest functions among those samples to `log.txt`. Kernel addresses
+//    are symbolized with the kernel symbol table and user addresses with
+//    the program image's own ELF symbols.
+
+#define PROFILE_NSAMPLES 1024   // samples kept (10 seconds at HZ)
+#define PROFILE_NHOTSPOTS 64    // distinct functions reported
+
+namespace {
+struct sample {
+    uintptr_t rip;
+    pid_t pid;                  // 0 for kernel samples
+    int program;                // program image number, or -1
+};
+
+struct hotspot {
+    int program;                // program image number, -1 for the kernel
+    uintptr_t start;            // function address (or %rip if unknown)
+    const char* name;           // function name, or `nullptr`
+    unsigned count;
+};
+}
+
+static sample samples[PROFILE_NSAMPLES];
+static unsigned long nsamples;  // samples taken since boot
+
+
+void profile_sample(uintptr_t rip, const proc* p) {
+    sample& s = samples[nsamples % PROFILE_NSAMPLES];
+    s.rip = rip;
+    s.pid = p ? p->pid : 0;
+    s.program = p ? p->program : -1;
+    ++nsamples;
+}
+
+
+void profile_dump() {
+    // `hot` is static because it is too big for the kernel stack
+    static hotspot hot[PROFILE_NHOTSPOTS];
+    int nhot = 0;
+    unsigned unlisted = 0;
+    unsigned n = min(nsamples, (unsigned long) PROFILE_NSAMPLES);
+
+    // aggregate samples by function
+    for (unsigned i = 0; i != n; ++i) {
+        const sample& s = samples[i];
+        int program = s.pid ? s.program : -1;
+        const char* name = nullptr;
+        uintptr_t start = s.rip;
+        if (program < 0) {
+            lookup_symbol(s.rip, &name, &start);
+        } else {
+            program_image(program).lookup_symbol(s.rip, &name, &start);
+        }
+        int h = 0;
+        while (h != nhot
+               && (hot[h].program != program || hot[h].start != start)) {
+            ++h;
+        }
+        if (h == nhot) {
+            if (nhot == PROFILE_NHOTSPOTS) {
+                ++unlisted;
+                continue;
+            }
+            hot[h] = {program, start, name, 0};
+            ++nhot;
+        }
+        ++hot[h].count;
+    }
+
+    // sort by count, hottest first
+    for (int i = 1; i < nhot; ++i) {
+        hotspot x = hot[i];
+        int j = i;
+        for (; j > 0 && hot[j - 1].count < x.count; --j) {
+            hot[j] = hot[j - 1];
+        }
+        hot[j] = x;
+    }
+
+    log_printf("profile: %lu samples, last %u shown\n", nsamples, n);
+    for (int i = 0; i != nhot; ++i) {
+        const char* where = hot[i].program < 0
+            ? "kernel" : program_image::program_name(hot[i].program);
+        if (hot[i].name) {
+            log_printf("%6u %3u%%  %s: %s\n", hot[i].count,
+                       hot[i].count * 100 / n, where, hot[i].name);
+        } else {
+            log_printf("%6u %3u%%  %s: %p\n", hot[i].count,
+                       hot[i].count * 100 / n, where, hot[i].start);
+        }
+    }
+    if (unlisted) {
+        log_printf("%6u       (other functions)\n", unlisted);
+    }
+}
@@ -33,10 +33,12 @@ void vmiter::down() {
         x86_64_pagetable* pt = reinterpret_cast<x86_64_pagetable*>(pa);
         pep_ = &pt->entry[pageindex(va_, level_)];
     }
+#ifndef NDEBUG
     if ((*pep_ & PTE_PAMASK) >= 0x100000000UL) {
         panic("Page table %p may contain uninitialized memory!\n"
               "(Page table contents: %p)\n", pt_, *pep_);
     }
+#endif
 }
 
 void vmiter::real_find(uintptr_t va) {
@@ -65,16 +67,20 @@ void vmiter::next() {
     real_find((va_ | pageoffmask(level)) + 1);
 }
 
-int vmiter::try_map(uintptr_t pa, int perm) {
+int vmiter::try_map(uintptr_t pa, int perm, int level) {
+    assert(level >= 0 && level <= 2, "vmiter::try_map bad level");
     if (pa == (uintptr_t) -1 && perm == 0) {
         pa = 0;
     }
-    // virtual address is page-aligned
-    assert((va_ % PAGESIZE) == 0, "vmiter::try_map va not aligned");
+    // virtual address is aligned to the mapping size
+    assert((va_ & pageoffmask(level)) == 0, "vmiter::try_map va not aligned");
     if (perm & PTE_P) {
-        // if mapping present, physical address is page-aligned
+        // if mapping present, physical address is aligned too
         assert(pa != (uintptr_t) -1, "vmiter::try_map mapping nonexistent pa");
-        assert((pa & PTE_PAMASK) == pa, "vmiter::try_map pa not aligned");
+        assert((pa & PTE_PAMASK) == pa && (pa & pageoffmask(level)) == 0,
+               "vmiter::try_map pa not aligned");
+        // a large page cannot replace an existing page table page
+        assert(level_ >= level, "vmiter::try_map large page over page table");
     } else {
         assert((pa & PTE_P) == 0, "vmiter::try_map invalid pa");
     }
@@ -82,19 +88,18 @@ int vmiter::try_map(uintptr_t pa, int perm) {
     // imposed by higher-level page tables (`perm_`)
     assert(!(perm & ~perm_ & (PTE_P | PTE_W | PTE_U)));
 
-    while (level_ > 0 && perm) {
+    while (level_ > level && perm) {
         assert(!(*pep_ & PTE_P));
-        x86_64_pagetable* pt = (x86_64_pagetable*) kalloc(PAGESIZE);
+        x86_64_pagetable* pt = (x86_64_pagetable*) kalloc_zeroed();
         if (!pt) {
             return -1;
         }
-        memset(pt, 0, PAGESIZE);
         *pep_ = (uintptr_t) pt | PTE_P | PTE_W | PTE_U;
         down();
     }
 
-    if (level_ == 0) {
-        *pep_ = pa | perm;
+    if (level_ == level) {
+        *pep_ = pa | perm | (level > 0 && (perm & PTE_P) ? PTE_PS : 0);
     }
     return 0;
 }
@@ -65,15 +65,19 @@ class vmiter {
     // Map current virtual address to `pa` with permissions `perm`.
     // The current virtual address must be page-aligned. Calls `kalloc`
     // to allocate page table pages if necessary; panics on failure.
-    inline void map(uintptr_t pa, int perm);
+    // A nonzero `level` installs a large page at that page table level
+    // (1 = 2 MiB, 2 = 1 GiB); then the virtual address and `pa` must be
+    // aligned to the large page size.
+    inline void map(uintptr_t pa, int perm, int level = 0);
     // Same, but map a kernel pointer
     inline void map(void* kptr, int perm);
 
     // Map current virtual address to `pa` with permissions `perm`.
     // The current virtual address must be page-aligned. Calls `kalloc`
     // to allocate page table pages if necessary; returns 0 on success
-    // and -1 on failure.
-    [[gnu::warn_unused_result]] int try_map(uintptr_t pa, int perm);
+    // and -1 on failure. `level` is as for `map`.
+    [[gnu::warn_unused_result]] int try_map(uintptr_t pa, int perm,
+                                            int level = 0);
     [[gnu::warn_unused_result]] inline int try_map(void* kptr, int perm);
 
   private:
@@ -223,8 +227,8 @@ inline void vmiter::operator--(int) {
 inline void vmiter::next_range() {
     real_find(last_va());
 }
-inline void vmiter::map(uintptr_t pa, int perm) {
-    int r = try_map(pa, perm);
+inline void vmiter::map(uintptr_t pa, int perm, int level) {
+    int r = try_map(pa, perm, level);
     assert(r == 0, "vmiter::map failed");
 }
 inline void vmiter::map(void* kp, int perm) {
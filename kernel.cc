@@ -23,38 +23,141 @@
 
 #define PROC_SIZE 0x40000       // initial state only
 
-proc ptable[NPROC];             // array of process descriptors
+proc* ptable[NPROC];            // process descriptors, indexed by pid
                                 // Note that `ptable[0]` is never used.
-proc* current;                  // pointer to currently executing proc
+#define current (this_cpu()->running) // process running on this CPU
+
+// The kernel lock. Kernel code runs on one CPU at a time: entering the
+// kernel from user mode takes this lock, and `run` and `syscall_finish`
+// release it just before returning to a process. The idle loop in
+// `schedule` releases it while it halts. The lock protects all kernel
+// data, so nothing else in the kernel needs locking.
+static spinlock kernel_lock;
 
 #define HZ 100                  // timer interrupt frequency (interrupts/sec)
-static std::atomic<unsigned long> ticks; // # timer interrupts so far
+static std::atomic<unsigned long> ticks; // # timer periods so far
+static proc* sleepers;          // processes blocked in `sys_sleep`, ordered
+                                // by `wakeup_tick` and linked by `runq_next`
+static vdso_data* vdso;         // shared vDSO page (see `VDSO_ADDR`)
+
+
+// Performance counters (see `kernel_stats` in lib.hh)
+static kernel_stats stats;
+static unsigned long* stats_cycles;     // cycle counter being charged
+static uint64_t stats_start;            // TSC when charging started
+#if WEENSYOS_STATSDUMP
+static void stats_dump();
+#endif
+
+static void stats_stop() {
+    if (stats_cycles) {
+        *stats_cycles += rdtsc() - stats_start;
+        stats_cycles = nullptr;
+    }
+}
+
+// stats_timer
+//    Charges cycles to `*cycles` from construction until `stats_stop`
+//    runs: on leaving the scope, in `run`, or when the kernel goes idle.
+struct stats_timer {
+    stats_timer(unsigned long* cycles) {
+        stats_cycles = cycles;
+        stats_start = rdtsc();
+    }
+    ~stats_timer() {
+        stats_stop();
+    }
+    NO_COPY_OR_ASSIGN(stats_timer);
+};
+static void timer_interrupt();
+static void update_timer();
+static uint32_t update_ticks();
 
 
 // Memory state - see `kernel.hh`
 physpageinfo physpages[NPAGES];
+static physpageinfo* free_physpages;    // head of the free page list
+
+// Process descriptor slabs. Each slab is one `kalloc` page: a `procslab`
+// header followed by `PROCS_PER_SLAB` descriptors. Free descriptors are
+// linked through `runq_next`.
+struct procslab {
+    procslab* prev;                     // links in `partial_procslabs`
+    procslab* next;
+    proc* free;                         // free descriptors in this slab
+    unsigned nused;                     // number of allocated descriptors
+};
+#define PROCS_PER_SLAB ((PAGESIZE - sizeof(procslab)) / sizeof(proc))
+static procslab* partial_procslabs;     // slabs with free descriptors
+static proc* kalloc_proc();
+static void kfree_proc(proc* p);
+
+// Free process IDs, used as a FIFO ring: `kalloc_proc` takes the pid at
+// `free_pids_head` and `kfree_proc` appends at the tail. `init_procs`
+// queues them lowest first. A freed pid is reused only after every other
+// free pid, so a stale pid (say, one passed to `sys_waitpid` after its
+// process exited) rarely names an unrelated process.
+static pid_t free_pids[NPROC];
+static int free_pids_head;
+static int nfree_pids;
+
+// Run queues: each CPU's runnable processes, in the order `schedule` will
+// pick them (see `cpustate::runq_head`). Change process states with
+// `set_state` to keep them up to date.
+static void set_state(proc* p, int state);
+static bool is_running(proc* p);
+
+// Pool of pre-zeroed pages, topped up by `schedule` while the CPU is idle.
+// Pooled pages have `refcount == 1` but are mapped nowhere.
+#define ZEROPOOL_SIZE 16
+static void* zeroed_pages[ZEROPOOL_SIZE];
+static int nzeroed_pages;
 
 
 [[noreturn]] void schedule();
 [[noreturn]] void run(proc* p);
 void exception(regstate* regs);
 uintptr_t syscall(regstate* regs);
+uintptr_t syscall_finish();
 void memshow();
 
 
 // kernel_start(command)
 //    Initialize the hardware and processes and start running. The `command`
-//    string is an optional string passed from the boot loader.
+//    string is an optional string passed from the boot loader. Kernels
+//    built with `make BOOTCOMMAND=NAME` run program NAME when there is none.
 
-static void process_setup(pid_t pid, const char* program_name);
+static proc* process_setup(const char* program_name);
+static void init_physpages();
+static void init_procs();
 
 void kernel_start(const char* command) {
     // initialize hardware
     init_hardware();
+    kernel_lock.lock();
     log_printf("Starting WeensyOS\n");
 
+    // build the physical page free list and the free pid list
+    init_physpages();
+    init_procs();
+
+    // start the other CPUs; they wait for the kernel lock, which the
+    // first `run` releases
+    init_other_cpus();
+
+    // set up the shared vDSO page
+    vdso = reinterpret_cast<vdso_data*>(kalloc_zeroed());
+    if (!vdso) {
+        panic("Out of memory!");
+    }
+    vdso->hz = HZ;
+    vdso->tsc_hz = measure_tsc_hz();
+
     ticks = 1;
+    vdso->ticks = ticks;
+#if !WEENSYOS_TICKLESS
     init_timer(HZ);
+#endif
 
     // clear screen
     console_clear();
@@ -72,23 +175,45 @@ void kernel_start(const char* command) {
             it.map(it.va(), PTE_P| PTE_W| PTE_U);
         }
     }
+    // flush translations cached under the old permissions
+    wrcr3(kptr2pa(kernel_pagetable));
 
-    // set up process descriptors
-    for (pid_t i = 0; i < NPROC; i++) {
-        ptable[i].pid = i;
-        ptable[i].state = P_FREE;
+    // set up processes
+#ifdef WEENSYOS_BOOTCOMMAND
+    if (!command) {
+        command = WEENSYOS_BOOTCOMMAND;
     }
+#endif
+    proc* first;
     if (command && !program_image(command).empty()) {
-        process_setup(1, command);
+        first = process_setup(command);
     } else {
-        process_setup(1, "allocator");
-        process_setup(2, "allocator2");
-        process_setup(3, "allocator3");
-        process_setup(4, "allocator4");
+        first = process_setup("allocator");
+        process_setup("allocator2");
+        process_setup("allocator3");
+        process_setup("allocator4");
     }
 
     // Switch to the first process using run()
-    run(&ptable[1]);
+    run(first);
+}
+
+
+// ap_kernel_start()
+//    Run processes on an application processor. Its run queue starts out
+//    empty, so `schedule` steals work from the other CPUs. Tickless
+//    kernels (`make TICKLESS=1`) keep time with the boot CPU's one-shot
+//    timer alone, so there the other CPUs stay parked.
+
+void ap_kernel_start() {
+#if WEENSYOS_TICKLESS
+    while (true) {
+        asm volatile("cli; hlt");
+    }
+#endif
+    kernel_lock.lock();
+    init_timer(HZ);
+    schedule();
 }
 
 
@@ -107,103 +232,488 @@ void kernel_start(const char* command) {
 //    the allocation fails; if `sz < PAGESIZE` it allocates a whole page
 //    anyway.
 //
-//    The handout code returns the next allocatable free page it can find.
-//    It checks all pages. (You could maybe make this faster!)
+//    Free pages are kept on a singly-linked list threaded through
+//    `physpages[].next_free`, so allocation and freeing take constant time
+//    regardless of `MEMSIZE_PHYSICAL`. Each CPU also caches up to
+//    PAGECACHE_SIZE free pages (`cpustate::pagecache`); `kalloc` and `kfree`
+//    use that cache first and move pages to and from the shared list in
+//    batches of PAGECACHE_SIZE / 2.
 //
-//    The returned memory is initially filled with 0xCC, which corresponds to
-//    the x86 instruction `int3`. This may help you debug.
+//    In debug builds (without `NDEBUG`), the returned memory is initially
+//    filled with 0xCC, which corresponds to the x86 instruction `int3`.
+//    This may help you debug. When the free list is empty, `kalloc` takes
+//    the pages cached by the other CPUs, then falls back to the pre-zeroed
+//    pool, so neither caching nor pooling causes allocations to fail. When
+//    the pool is empty too, it asks `reclaim_pages` to give back cached
+//    pages before failing.
+
+static bool refill_pagecache(cpustate* c);
+static void drain_pagecache(cpustate* c);
+static bool take_pagecaches(cpustate* c);
+static size_t reclaim_pages();
 
 void* kalloc(size_t sz) {
     if (sz > PAGESIZE) {
         return nullptr;
     }
-    for (uintptr_t pa = 0; pa != MEMSIZE_PHYSICAL; pa += PAGESIZE) {
-        if (allocatable_physical_address(pa)
-            && physpages[pa / PAGESIZE].refcount == 0) {
-            ++physpages[pa / PAGESIZE].refcount;
-            memset((void*) pa, 0xCC, PAGESIZE);
-            return (void*) pa;
+    cpustate* c = this_cpu();
+    if (c->npagecache != 0) {
+        ++c->pagecache_hits;
+    } else {
+        ++c->pagecache_misses;
+        if (!refill_pagecache(c) && !take_pagecaches(c)) {
+            if (nzeroed_pages) {
+                return zeroed_pages[--nzeroed_pages];
+            }
+            // reclaimed pages are freed into this CPU's page cache
+            if (!reclaim_pages() || c->npagecache == 0) {
+                return nullptr;
+            }
         }
     }
-    return nullptr;
+    uintptr_t pa = kptr2pa(c->pagecache[--c->npagecache]);
+    physpageinfo* pp = &physpages[pa / PAGESIZE];
+    assert(pp->refcount == 0);
+    pp->refcount = 1;
+    ++stats.pages_allocated;
+#ifndef NDEBUG
+    memset((void*) pa, 0xCC, PAGESIZE);
+#endif
+    return (void*) pa;
+}
+
+
+// kalloc_zeroed()
+//    Allocate a zero-filled page, or return `nullptr` on failure. Takes a
+//    page from the pre-zeroed pool if possible, so the common case does no
+//    page writes at all.
+
+void* kalloc_zeroed() {
+    if (nzeroed_pages) {
+        return zeroed_pages[--nzeroed_pages];
+    }
+    void* pa = kalloc(PAGESIZE);
+    if (pa) {
+        memzero_page(pa);
+    }
+    return pa;
+}
+
+
+// refill_zeroed_pages()
+//    Zero one free page and add it to the pre-zeroed pool, if the pool has
+//    room. Called from the idle loop. Returns true if it zeroed a page.
+
+static bool refill_zeroed_pages() {
+    if (nzeroed_pages < ZEROPOOL_SIZE
+        && (free_physpages || this_cpu()->npagecache)) {
+        void* pa = kalloc(PAGESIZE);
+        if (!pa) {
+            return false;
+        }
+        memzero_page(pa);
+        zeroed_pages[nzeroed_pages++] = pa;
+        return true;
+    }
+    return false;
 }
 
 
 // kfree(kptr)
 //    Free `kptr`, which must have been previously returned by `kalloc`.
-//    If `kptr == nullptr` does nothing.
+//    If `kptr == nullptr` does nothing. Shared pages are only returned to
+//    the free list when their last reference is dropped.
 
 void kfree(void* kptr) {
     if (!kptr){
         return;
     }
-    --physpages[(uintptr_t)kptr/ PAGESIZE].refcount;
+    uintptr_t pa = kptr2pa(kptr);
+    assert(pa % PAGESIZE == 0 && allocatable_physical_address(pa));
+    physpageinfo* pp = &physpages[pa / PAGESIZE];
+    assert(pp->refcount > 0);
+    if (--pp->refcount != 0) {
+        return;
+    }
+    ++stats.pages_freed;
+    cpustate* c = this_cpu();
+    if (c->npagecache == PAGECACHE_SIZE) {
+        drain_pagecache(c);
+    }
+    c->pagecache[c->npagecache++] = kptr;
 }
 
-// process_setup(pid, program_name)
-//    Load application program `program_name` as process number `pid`.
-//    This loads the application's code and data into memory, sets its
-//    %rip and %rsp, gives it a stack page, and marks it as runnable.
 
-void process_setup(pid_t pid, const char* program_name) {
-    init_process(&ptable[pid], 0);
+// refill_pagecache(c), drain_pagecache(c)
+//    Move up to PAGECACHE_SIZE / 2 pages from the shared free list into
+//    CPU `c`'s page cache, or from the cache back to the list. Refilling
+//    returns false if no pages were available.
 
-    // initialize process page table
-    ptable[pid].pagetable = kalloc_pagetable();
+bool refill_pagecache(cpustate* c) {
+    while (c->npagecache < PAGECACHE_SIZE / 2 && free_physpages) {
+        physpageinfo* pp = free_physpages;
+        free_physpages = pp->next_free;
+        pp->next_free = nullptr;
+        c->pagecache[c->npagecache++] = (void*) ((pp - physpages) * PAGESIZE);
+    }
+    return c->npagecache != 0;
+}
+
+void drain_pagecache(cpustate* c) {
+    while (c->npagecache > PAGECACHE_SIZE / 2) {
+        uintptr_t pa = kptr2pa(c->pagecache[--c->npagecache]);
+        physpageinfo* pp = &physpages[pa / PAGESIZE];
+        pp->next_free = free_physpages;
+        free_physpages = pp;
+    }
+}
+
+
+// take_pagecaches(c)
+//    Move the pages cached by the other CPUs into CPU `c`'s page cache, so
+//    memory stranded in an idle CPU's cache can still be allocated. Returns
+//    false if the other caches were all empty.
+
+bool take_pagecaches(cpustate* c) {
+    for (int i = 0; i != MAXCPU && c->npagecache != PAGECACHE_SIZE; ++i) {
+        cpustate* o = &cpus[i];
+        while (o != c && o->npagecache != 0
+               && c->npagecache != PAGECACHE_SIZE) {
+            c->pagecache[c->npagecache++] = o->pagecache[--o->npagecache];
+        }
+    }
+    return c->npagecache != 0;
+}
+
+
+// init_physpages()
+//    Build the free page list from `allocatable_physical_address`. Pages are
+//    pushed from the top of memory down, so early allocations return low,
+//    ascending addresses.
+
+void init_physpages() {
+    free_physpages = nullptr;
+    for (uintptr_t pa = MEMSIZE_PHYSICAL; pa != 0; ) {
+        pa -= PAGESIZE;
+        physpageinfo* pp = &physpages[pa / PAGESIZE];
+        if (allocatable_physical_address(pa) && pp->refcount == 0) {
+            pp->next_free = free_physpages;
+            free_physpages = pp;
+        }
+    }
+}
+
+
+// init_procs()
+//    Mark every process ID except 0 as free.
+
+void init_procs() {
+    free_pids_head = 0;
+    nfree_pids = 0;
+    for (pid_t pid = 1; pid != NPROC; ++pid) {
+        free_pids[nfree_pids++] = pid;
+    }
+}
+
+
+// procslab_link(s), procslab_unlink(s)
+//    Add slab `s` to, or remove it from, the list of partial slabs.
+
+static void procslab_link(procslab* s) {
+    s->prev = nullptr;
+    s->next = partial_procslabs;
+    if (s->next) {
+        s->next->prev = s;
+    }
+    partial_procslabs = s;
+}
+
+static void procslab_unlink(procslab* s) {
+    (s->prev ? s->prev->next : partial_procslabs) = s->next;
+    if (s->next) {
+        s->next->prev = s->prev;
+    }
+}
+
+
+// kalloc_proc()
+//    Allocate a zeroed process descriptor from the slabs, along with a
+//    process ID, and enter it in `ptable`. Returns `nullptr` if memory or
+//    process IDs run out.
+
+proc* kalloc_proc() {
+    if (nfree_pids == 0) {
+        return nullptr;
+    }
+    procslab* s = partial_procslabs;
+    if (!s) {
+        s = reinterpret_cast<procslab*>(kalloc(PAGESIZE));
+        if (!s) {
+            return nullptr;
+        }
+        s->free = nullptr;
+        s->nused = 0;
+        proc* ps = reinterpret_cast<proc*>(s + 1);
+        for (size_t i = PROCS_PER_SLAB; i != 0; --i) {
+            ps[i - 1].runq_next = s->free;
+            s->free = &ps[i - 1];
+        }
+        procslab_link(s);
+    }
+
+    proc* p = s->free;
+    s->free = p->runq_next;
+    if (!s->free) {
+        procslab_unlink(s);
+    }
+    ++s->nused;
+
+    *p = proc();
+    p->pid = free_pids[free_pids_head];
+    free_pids_head = (free_pids_head + 1) % NPROC;
+    --nfree_pids;
+    p->pcid = p->pid;
+    ptable[p->pid] = p;
+    return p;
+}
+
+
+// kfree_proc(p)
+//    Free process descriptor `p`, which must not be runnable, and its
+//    process ID. Empty slabs are returned to `kfree`, except that one is
+//    kept so a steady fork/exit loop does not churn pages.
+
+void kfree_proc(proc* p) {
+    assert(p->state != P_RUNNABLE && ptable[p->pid] == p);
+    ptable[p->pid] = nullptr;
+    free_pids[(free_pids_head + nfree_pids) % NPROC] = p->pid;
+    ++nfree_pids;
+
+    procslab* s = reinterpret_cast<procslab*>(
+        round_down(reinterpret_cast<uintptr_t>(p), PAGESIZE));
+    if (!s->free) {
+        procslab_link(s);
+    }
+    p->runq_next = s->free;
+    s->free = p;
+    if (--s->nused == 0 && (s->prev || s->next)) {
+        procslab_unlink(s);
+        kfree(s);
+    }
+}
+
+
+// copy_kernel_mappings(pt)
+//    Install the kernel's mappings below PROC_START_ADDR in the empty page
+//    table `pt`. They all live in the first level-0 page table page, so
+//    this copies that page's kernel entries wholesale instead of mapping
+//    page by page. (The page itself cannot be shared between processes:
+//    it also maps user memory from PROC_START_ADDR up to 2 MiB. Sharing
+//    would need PROC_START_ADDR on a 2 MiB boundary.) Returns 0 on success
+//    and -1 if out of memory.
+
+static_assert(PROC_START_ADDR <= PAGESIZE / sizeof(x86_64_pageentry_t)
+                                 * PAGESIZE,
+              "kernel mappings must fit in one level-0 page table page");
+
+static int copy_kernel_mappings(x86_64_pagetable* pt) {
+    // allocate the path to the first level-0 page table page
+    if (vmiter(pt, KERNEL_START_ADDR).try_map(KERNEL_START_ADDR,
+                                              PTE_P | PTE_W) < 0) {
+        return -1;
+    }
+    x86_64_pagetable* l0 = ptiter(pt).kptr();
+    x86_64_pagetable* kl0 = ptiter(kernel_pagetable).kptr();
+    memcpy(l0->entry, kl0->entry,
+           sizeof(x86_64_pageentry_t) * (PROC_START_ADDR / PAGESIZE));
+    return 0;
+}
+
+
+// map_vdso(p)
+//    Map the vDSO pages into `p`'s page table, allocating its per-process
+//    page. Returns 0 on success and -1 if out of memory.
+
+static int map_vdso(proc* p) {
+    auto data = reinterpret_cast<vdso_proc_data*>(kalloc_zeroed());
+    if (!data) {
+        return -1;
+    }
+    data->pid = p->pid;
+    vmiter it(p, VDSO_PROC_ADDR);
+    if (it.try_map(data, PTE_P | PTE_U) < 0) {
+        kfree(data);
+        return -1;
+    }
+    return it.find(VDSO_ADDR).try_map(vdso, PTE_P | PTE_U);
+}
+
+
+// Shared program text
+//    Read-only segment pages are identical in every process running a
+//    program, so they are loaded once per program image and mapped shared.
+//    `textpages` records each loaded page by program number and virtual
+//    address, and holds a reference to it, so later launches of the program
+//    map the cached page instead of copying the image again.
+
+struct textpage {
+    int program;
+    uintptr_t va;
+    void* pa;
+};
+#define NTEXTPAGES 64
+static textpage textpages[NTEXTPAGES];
+static int ntextpages;
+
+// find_textpage(program, va)
+//    Return a new reference to the cached read-only page for `program` at
+//    `va`, or `nullptr` if it is not cached.
+
+static void* find_textpage(int program, uintptr_t va) {
+    for (int i = 0; i != ntextpages; ++i) {
+        if (textpages[i].program == program && textpages[i].va == va) {
+            ++physpages[kptr2pa(textpages[i].pa) / PAGESIZE].refcount;
+            return textpages[i].pa;
+        }
+    }
+    return nullptr;
+}
+
+// cache_textpage(program, va, pa)
+//    Remember `pa` as the read-only page for `program` at `va`, if there
+//    is room in the cache.
 
-    auto pit = vmiter(ptable[pid].pagetable);
+static void cache_textpage(int program, uintptr_t va, void* pa) {
+    if (ntextpages != NTEXTPAGES) {
+        textpages[ntextpages] = {program, va, pa};
+        ++ntextpages;
+        ++physpages[kptr2pa(pa) / PAGESIZE].refcount;
+    }
+}
 
-    for (vmiter kit(kernel_pagetable); kit.va() < PROC_START_ADDR; kit+=PAGESIZE){
-        pit.map(kit.pa(), kit.perm());
-        pit+=PAGESIZE;
+
+// reclaim_pages()
+//    Called by `kalloc` when free memory runs out. Evicts cached text
+//    pages that no process maps (the cache holds their only reference);
+//    they are clean, so the next launch of the program simply reloads
+//    them from its image. Returns the number of pages freed.
+
+size_t reclaim_pages() {
+    size_t n = 0;
+    for (int i = 0; i != ntextpages; ) {
+        void* pa = textpages[i].pa;
+        if (physpages[kptr2pa(pa) / PAGESIZE].refcount == 1) {
+            textpages[i] = textpages[--ntextpages];
+            kfree(pa);
+            ++n;
+        } else {
+            ++i;
+        }
     }
-    // obtain reference to the program image
-    program_image pgm(program_name);
+    stats.pages_reclaimed += n;
+    return n;
+}
+
+
+// load_program(p, program)
+//    Load program image number `program` into `p`'s page table, which
+//    must have no user mappings, and set `p`'s %rip and %rsp. Maps the
+//    image's segments and a stack page. Returns 0 on success and -1 if
+//    memory runs out.
+
+static int load_program(proc* p, int program) {
+    auto pit = vmiter(p->pagetable);
+    program_image pgm(program);
+    p->program = program;
 
-    // allocate and map global memory required by loadable segments
+    // allocate, initialize, and map memory required by loadable segments
+    // (pages come from the free list, so they need not be contiguous)
     for (auto seg = pgm.begin(); seg != pgm.end(); ++seg) {
         for (uintptr_t a = round_down(seg.va(), PAGESIZE);
              a < seg.va() + seg.size();
              a += PAGESIZE) {
             // `a` is the process virtual address for the next code or data page
-            // (The handout code requires that the corresponding physical
-            // address is currently free.)
-            void* pa = kalloc(PAGESIZE);
+            pit.find(a);
+            if (!seg.writable()) {
+                if (void* pa = find_textpage(program, a)) {
+                    if (pit.try_map(pa, PTE_P | PTE_U) < 0) {
+                        kfree(pa);
+                        return -1;
+                    }
+                    continue;
+                }
+            }
+            void* pa = kalloc_zeroed();
             if (!pa){
-                panic("Out of memory!");
+                return -1;
             }
-            pit.find(a);
-            if (seg.writable()){
-                pit.map((uintptr_t) pa, PTE_W| PTE_P | PTE_U);
+            // copy in any data bytes this page holds
+            uintptr_t data_start = max(a, seg.va());
+            uintptr_t data_end = min(a + PAGESIZE, seg.va() + seg.data_size());
+            if (data_start < data_end) {
+                memcpy((char*) pa + (data_start - a),
+                       seg.data() + (data_start - seg.va()),
+                       data_end - data_start);
+            }
+            int perm = seg.writable() ? PTE_W | PTE_P | PTE_U : PTE_P | PTE_U;
+            if (pit.try_map(pa, perm) < 0) {
+                kfree(pa);
+                return -1;
             }
-            else{
-                pit.map((uintptr_t) pa, PTE_P | PTE_U);
+            if (!seg.writable()) {
+                cache_textpage(program, a, pa);
             }
         }
     }
 
-    // initialize data in loadable segments
-    for (auto seg = pgm.begin(); seg != pgm.end(); ++seg) {
-        pit.find(seg.va());
-        memset((void*) pit.pa(), 0, seg.size());
-        memcpy((void*) pit.pa(), seg.data(), seg.data_size());
-    }
-
     // mark entry point
-    ptable[pid].regs.reg_rip = pgm.entry();
+    p->regs.reg_rip = pgm.entry();
 
     // allocate and map stack segment
     // Compute process virtual address for stack page
+    // (`kalloc` memory may hold another process's data, so zero it.)
     uintptr_t stack_addr = MEMSIZE_VIRTUAL - PAGESIZE;
-    void* pa = kalloc(PAGESIZE);
+    void* pa = kalloc_zeroed();
     if (!pa){
-        panic("Out of memory!");
+        return -1;
     }
     pit.find(stack_addr);
-    pit.map((uintptr_t) pa, PTE_W| PTE_P| PTE_U);
-    ptable[pid].regs.reg_rsp = stack_addr + PAGESIZE;
+    if (pit.try_map(pa, PTE_W | PTE_P | PTE_U) < 0) {
+        kfree(pa);
+        return -1;
+    }
+    p->regs.reg_rsp = stack_addr + PAGESIZE;
+    return 0;
+}
+
+
+// process_setup(program_name)
+//    Load application program `program_name` as a new process.
+//    This loads the application's code and data into memory, sets its
+//    %rip and %rsp, gives it a stack page, and marks it as runnable.
+//    Returns the new process.
+
+proc* process_setup(const char* program_name) {
+    proc* p = kalloc_proc();
+    if (!p) {
+        panic("Out of memory!");
+    }
+    init_process(p, 0);
+
+    // initialize process page table
+    p->pagetable = kalloc_pagetable();
+    if (!p->pagetable || copy_kernel_mappings(p->pagetable) < 0
+        || map_vdso(p) < 0) {
+        panic("Out of memory!");
+    }
+
+    if (load_program(p, program_image::program_number(program_name)) < 0) {
+        panic("Out of memory!");
+    }
+
     // mark process as runnable
-    ptable[pid].state = P_RUNNABLE;
+    set_state(p, P_RUNNABLE);
+    return p;
 }
 
 
@@ -219,37 +729,120 @@ void process_setup(pid_t pid, const char* program_name) {
 //
 //    Note that hardware interrupts are disabled when the kernel is running.
 
+static bool resolve_cow_fault(proc* p, uintptr_t addr);
+static bool resolve_lazy_fault(proc* p, uintptr_t addr);
+static void* kalloc_user(bool zeroed);
+
+// count_exception(regs)
+//    Count exception `regs->reg_intno` and return the cycle counter to
+//    charge for handling it, if any.
+
+static unsigned long* count_exception(regstate* regs) {
+    if (regs->reg_intno < NSTATS_EXCEPTIONS) {
+        ++stats.exceptions[regs->reg_intno];
+        return &stats.exception_cycles[regs->reg_intno];
+    }
+    return nullptr;
+}
+
+// idle_interrupt(regs)
+//    Handle an interrupt taken in kernel mode. These arrive while
+//    `schedule` halts in its idle loop, and only need acknowledging.
+
+static void idle_interrupt(regstate* regs) {
+    stats_timer timer(count_exception(regs));
+    if (regs->reg_intno == INT_IRQ + IRQ_TIMER) {
+#if WEENSYOS_PROFILE
+        profile_sample(regs->reg_rip, nullptr);
+#endif
+        if (this_cpu() == &cpus[0]) {
+            timer_interrupt();
+        }
+    }
+    if (regs->reg_intno != INT_IRQ + IRQ_SPURIOUS) {
+        lapicstate::get().ack();
+    }
+}
+
 void exception(regstate* regs) {
-    // Copy the saved registers into the `current` process descriptor.
-    current->regs = *regs;
-    regs = &current->regs;
+    // The idle loop runs without the kernel lock, so its interrupts take
+    // the lock just while they are handled; `exception_entry` then
+    // returns to the idle loop.
+    if ((regs->reg_cs & 3) == 0 && regs->reg_intno >= INT_IRQ) {
+        spinlock_guard guard(kernel_lock);
+        idle_interrupt(regs);
+        return;
+    }
+
+    // Kernel faults are not recoverable (and the faulting code may hold
+    // the kernel lock already). Otherwise, take the lock and copy the
+    // saved registers into the `current` process descriptor.
+    if ((regs->reg_cs & 3) != 0) {
+        kernel_lock.lock();
+        current->regs = *regs;
+        regs = &current->regs;
+    }
+    stats_timer timer(count_exception(regs));
 
     // It can be useful to log events using `log_printf`.
     // Events logged this way are stored in the host's `log.txt` file.
     //log_printf("proc %d: exception %d at rip %p\n", current->pid, regs->reg_intno, regs->reg_rip);
 
-    // Show the current cursor location and memory state
-    // (unless this is a kernel fault).
+    // Show the current cursor location.
     console_show_cursor(cursorpos);
-    if (regs->reg_intno != INT_PF || (regs->reg_errcode & PTE_U)) {
-        memshow();
-    }
 
-    // If Control-C was typed, exit the virtual machine.
-    check_keyboard();
+    // If Control-C was typed, exit the virtual machine. (Keyboard
+    // interrupts go to the boot CPU, so only it reads the keyboard.)
+    bool boot_cpu = this_cpu() == &cpus[0];
+    if (boot_cpu) {
+        check_keyboard();
+    }
 
     // Actually handle the exception.
     switch (regs->reg_intno) {
 
     case INT_IRQ + IRQ_TIMER:
-        ++ticks;
+#if WEENSYOS_PROFILE
+        profile_sample(regs->reg_rip, current);
+#endif
         lapicstate::get().ack();
+        // Only the boot CPU keeps time. It also redraws the memory state
+        // and writes out the log once per tick, not on every trap.
+        if (boot_cpu) {
+            timer_interrupt();
+            memshow();
+#if WEENSYOS_STATSDUMP
+            stats_dump();
+#endif
+            log_flush();
+        }
         schedule();
         break;                  /* will not be reached */
 
+    case INT_IRQ + IRQ_KEYBOARD:
+        // `check_keyboard` above consumed the key.
+        lapicstate::get().ack();
+        break;
+
+    case INT_IRQ + IRQ_SPURIOUS:
+        break;
+
     case INT_PF: {
         // Analyze faulting address and access type.
         uintptr_t addr = rdcr2();
+
+        // User writes to copy-on-write pages are resolved here.
+        if ((regs->reg_errcode & (PTE_P | PTE_W | PTE_U))
+                == (PTE_P | PTE_W | PTE_U)
+            && resolve_cow_fault(current, addr)) {
+            break;
+        }
+        // So are user faults on missing pages in demand-paged regions.
+        if ((regs->reg_errcode & (PTE_P | PTE_U)) == PTE_U
+            && resolve_lazy_fault(current, addr)) {
+            break;
+        }
+
         const char* operation = regs->reg_errcode & PTE_W
                 ? "write" : "read";
         const char* problem = regs->reg_errcode & PTE_P
@@ -262,7 +855,7 @@ void exception(regstate* regs) {
         console_printf(CPOS(24, 0), 0x0C00,
                        "Process %d page fault on %p (%s %s, rip=%p)!\n",
                        current->pid, addr, operation, problem, regs->reg_rip);
-        current->state = P_FAULTED;
+        set_state(current, P_FAULTED);
         break;
     }
     default:
@@ -278,6 +871,65 @@ void exception(regstate* regs) {
 }
 
 
+// resolve_cow_fault(p, addr)
+//    Handle a write fault by process `p` on a copy-on-write page containing
+//    `addr`. The last sharer simply regains write access; otherwise the page
+//    is copied. Returns false if `addr` is not copy-on-write or if memory
+//    runs out.
+
+bool resolve_cow_fault(proc* p, uintptr_t addr) {
+    vmiter it(p, round_down(addr, PAGESIZE));
+    if (!it.user() || !(it.perm() & PTE_COW)) {
+        return false;
+    }
+    // The fault already evicted `addr`'s stale TLB entry, so changing the
+    // mapping here needs no flush.
+    int perm = (it.perm() & ~PTE_COW) | PTE_W;
+    void* old_pa = it.kptr();
+    if (physpages[it.pa() / PAGESIZE].refcount == 1) {
+        it.map(old_pa, perm);
+        return true;
+    }
+    void* pa = kalloc_user(false);
+    if (!pa) {
+        return false;
+    }
+    memcpy_page(pa, old_pa);
+    it.map(pa, perm);
+    kfree(old_pa);
+    ++stats.cow_pages_copied;
+    return true;
+}
+
+
+// resolve_lazy_fault(p, addr)
+//    Handle a fault by process `p` on a missing page containing `addr`. If
+//    `addr` lies in one of `p`'s demand-paged regions and no page is mapped
+//    there yet, map a fresh zeroed page. Returns false otherwise, or if
+//    memory runs out.
+
+bool resolve_lazy_fault(proc* p, uintptr_t addr) {
+    vmiter it(p, round_down(addr, PAGESIZE));
+    if (it.present()) {
+        return false;
+    }
+    for (auto& r : p->regions) {
+        if (addr >= r.start && addr < r.end) {
+            void* pa = kalloc_user(true);
+            if (!pa) {
+                return false;
+            }
+            if (it.try_map(pa, r.perm) < 0) {
+                kfree(pa);
+                return false;
+            }
+            return true;
+        }
+    }
+    return false;
+}
+
+
 // syscall(regs)
 //    System call handler.
 //
@@ -287,24 +939,42 @@ void exception(regstate* regs) {
 //    Note that hardware interrupts are disabled when the kernel is running.
 
 int syscall_page_alloc(uintptr_t addr);
+int syscall_page_alloc_range(uintptr_t addr, uintptr_t npages, int flags);
+int syscall_mmap(uintptr_t addr, uintptr_t sz, int flags);
 int syscall_fork();
+void syscall_sleep(unsigned long nticks);
+int syscall_waitpid(pid_t pid);
+int syscall_exec(uintptr_t program_name);
+int syscall_shm_create(size_t sz);
+int syscall_shm_map(int id, uintptr_t addr);
+int syscall_getstats(uintptr_t addr);
+void syscall_log(uintptr_t msg);
 void syscall_exit(proc* process);
 uintptr_t syscall(regstate* regs) {
+    kernel_lock.lock();
+
     // Copy the saved registers into the `current` process descriptor.
     current->regs = *regs;
     regs = &current->regs;
 
+    unsigned stat = regs->reg_rax < NSTATS_SYSCALLS ? regs->reg_rax : 0;
+    ++stats.syscalls[stat];
+    stats_timer timer(&stats.syscall_cycles[stat]);
+
     // It can be useful to log events using `log_printf`.
     // Events logged this way are stored in the host's `log.txt` file.
     /* log_printf("proc %d: syscall %d at rip %p\n",
                   current->pid, regs->reg_rax, regs->reg_rip); */
 
-    // Show the current cursor location and memory state.
+    // Show the current cursor location. (The memory state is redrawn
+    // on timer interrupts.)
     console_show_cursor(cursorpos);
-    memshow();
 
-    // If Control-C was typed, exit the virtual machine.
-    check_keyboard();
+    // If Control-C was typed, exit the virtual machine. (Only the boot CPU
+    // reads the keyboard; see `exception`.)
+    if (this_cpu() == &cpus[0]) {
+        check_keyboard();
+    }
 
 
     // Actually handle the exception.
@@ -323,9 +993,42 @@ uintptr_t syscall(regstate* regs) {
         case SYSCALL_PAGE_ALLOC:
             return syscall_page_alloc(current->regs.reg_rdi);
 
+        case SYSCALL_PAGE_ALLOC_RANGE:
+            return syscall_page_alloc_range(current->regs.reg_rdi,
+                                            current->regs.reg_rsi,
+                                            current->regs.reg_rdx);
+
+        case SYSCALL_MMAP:
+            return syscall_mmap(current->regs.reg_rdi, current->regs.reg_rsi,
+                                current->regs.reg_rdx);
+
         case SYSCALL_FORK:
             return syscall_fork();
 
+        case SYSCALL_SLEEP:
+            syscall_sleep(current->regs.reg_rdi);
+            schedule();         // does not return
+
+        case SYSCALL_WAITPID:
+            return syscall_waitpid(current->regs.reg_rdi);
+
+        case SYSCALL_EXEC:
+            return syscall_exec(current->regs.reg_rdi);
+
+        case SYSCALL_SHM_CREATE:
+            return syscall_shm_create(current->regs.reg_rdi);
+
+        case SYSCALL_SHM_MAP:
+            return syscall_shm_map(current->regs.reg_rdi,
+                                   current->regs.reg_rsi);
+
+        case SYSCALL_GETSTATS:
+            return syscall_getstats(current->regs.reg_rdi);
+
+        case SYSCALL_LOG:
+            syscall_log(current->regs.reg_rdi);
+            return 0;
+
         case SYSCALL_EXIT:
             syscall_exit(current);
             schedule();         //does not return
@@ -338,13 +1041,334 @@ uintptr_t syscall(regstate* regs) {
     panic("Should not get here!\n");
 }
 
+
+// syscall_finish()
+//    Called by `syscall_entry` when `syscall` returns to the current
+//    process. Releases the kernel lock and returns the %cr3 value for the
+//    process.
+
+uintptr_t syscall_finish() {
+    assert(current->state == P_RUNNABLE);
+    uintptr_t cr3 = process_cr3(current);
+    kernel_lock.unlock();
+    return cr3;
+}
+
+
+// syscall_sleep(nticks)
+//    Block the current process for `nticks` timer ticks. Sleepers are kept
+//    sorted, so the timer interrupt only ever looks at the head.
+
+void syscall_sleep(unsigned long nticks) {
+    current->regs.reg_rax = 0;
+    update_ticks();
+    unsigned long now = ticks;
+    current->wakeup_tick = nticks < ~0UL - now ? now + nticks : ~0UL;
+    set_state(current, P_BLOCKED);
+    proc** pp = &sleepers;
+    while (*pp && (*pp)->wakeup_tick <= current->wakeup_tick) {
+        pp = &(*pp)->runq_next;
+    }
+    current->runq_next = *pp;
+    *pp = current;
+    update_timer();
+}
+
+
+// syscall_waitpid(pid)
+//    Block the current process until process `pid` exits. Returns -1
+//    immediately if there is no such process; otherwise does not return
+//    (`syscall_exit` wakes the waiter, which then returns `pid`).
+//
+//    There are no zombies: an exited process's pid is free at once, so
+//    waiting for a process that has already exited returns -1, and callers
+//    should treat -1 and `pid` alike as "it has exited". Freed pids are
+//    reused in FIFO order, so a stale `pid` names some unrelated process
+//    only once every pid that was free when it exited has been reused.
+
+int syscall_waitpid(pid_t pid) {
+    if (pid <= 0 || pid >= NPROC || pid == current->pid
+        || !ptable[pid] || ptable[pid]->state == P_FREE) {
+        return -1;
+    }
+    proc* p = ptable[pid];
+    current->regs.reg_rax = pid;
+    set_state(current, P_BLOCKED);
+    current->runq_next = p->waiters;
+    p->waiters = current;
+    schedule();
+}
+
+
+// syscall_exec(program_name)
+//    Replace the current process's image with program `program_name`.
+//    The page table is kept: only user mappings are torn down, so page
+//    table pages and the kernel mappings are reused by the new image.
+//    Returns -1 if the name is bad; otherwise does not return.
+
+int syscall_exec(uintptr_t program_name) {
+    // copy the program name out of user memory
+    char name[32];
+    vmiter nit(current, program_name);
+    for (size_t i = 0; true; ++i, ++nit) {
+        if (i == sizeof(name) || nit.va() < PROC_START_ADDR || !nit.user()) {
+            return -1;
+        }
+        name[i] = *nit.kptr<const char*>();
+        if (name[i] == '\0') {
+            break;
+        }
+    }
+    int program = program_image::program_number(name);
+    if (program < 0) {
+        return -1;
+    }
+
+    // tear down the old image
+    for (vmiter it(current, PROC_START_ADDR);
+         it.va() < MEMSIZE_VIRTUAL;
+         it.next()) {
+        if (it.user()) {
+            kfree(it.kptr());
+            it.map(nullptr, 0);
+        }
+    }
+    for (auto& r : current->regions) {
+        r = vmregion();
+    }
+    current->tlb_stale = true;
+
+    // load the new one
+    init_process(current, 0);
+    if (load_program(current, program) < 0) {
+        syscall_exit(current);
+        schedule();
+    }
+    run(current);
+}
+
+
+// Shared memory segments
+//    A segment holds one reference to each of its pages, so the pages
+//    survive while no process maps them. Each mapping holds another.
+
+#define NSHMSEGS 16
+#define SHM_MAXPAGES 16
+struct shmseg {
+    int npages = 0;                     // 0 means the slot is free
+    void* pages[SHM_MAXPAGES];
+};
+static shmseg shmsegs[NSHMSEGS];
+
+
+// syscall_shm_create(sz)
+//    Create a zero-filled shared memory segment of `sz` bytes. Returns its
+//    ID, or -1 on failure.
+
+int syscall_shm_create(size_t sz) {
+    if (sz == 0 || sz > SHM_MAXPAGES * PAGESIZE) {
+        return -1;
+    }
+    int id = 0;
+    while (id != NSHMSEGS && shmsegs[id].npages != 0) {
+        ++id;
+    }
+    if (id == NSHMSEGS) {
+        return -1;
+    }
+    shmseg& seg = shmsegs[id];
+    int npages = round_up(sz, PAGESIZE) / PAGESIZE;
+    for (int i = 0; i != npages; ++i) {
+        seg.pages[i] = kalloc_zeroed();
+        if (!seg.pages[i]) {
+            while (i > 0) {
+                --i;
+                kfree(seg.pages[i]);
+            }
+            return -1;
+        }
+    }
+    seg.npages = npages;
+    return id;
+}
+
+
+// syscall_shm_map(id, addr)
+//    Map shared memory segment `id` at `addr` in the current process.
+//    Returns 0 on success and -1 on failure.
+
+int syscall_shm_map(int id, uintptr_t addr) {
+    if (id < 0 || id >= NSHMSEGS || shmsegs[id].npages == 0) {
+        return -1;
+    }
+    shmseg& seg = shmsegs[id];
+    uintptr_t end = addr + seg.npages * PAGESIZE;
+    if (addr % PAGESIZE != 0 || addr < PROC_START_ADDR
+        || end > MEMSIZE_VIRTUAL) {
+        return -1;
+    }
+    vmiter it(current, addr);
+    for (; it.va() < end; it += PAGESIZE) {
+        if (it.present()) {
+            return -1;
+        }
+    }
+    for (it.find(addr); it.va() < end; it += PAGESIZE) {
+        void* pa = seg.pages[(it.va() - addr) / PAGESIZE];
+        if (it.try_map(pa, PTE_P | PTE_W | PTE_U | PTE_SHARED) < 0) {
+            // undo the mappings made so far
+            while (it.va() > addr) {
+                it -= PAGESIZE;
+                kfree(it.kptr());
+                it.map(nullptr, 0);
+            }
+            return -1;
+        }
+        ++physpages[kptr2pa(pa) / PAGESIZE].refcount;
+    }
+    return 0;
+}
+
+
+// copyout(addr, src, sz)
+//    Copy `sz` bytes from kernel memory `src` to the current process's
+//    memory at `addr`, resolving copy-on-write and demand-paged pages as a
+//    user write would. Returns 0 on success and -1 if the destination is
+//    not writable user memory.
+
+static int copyout(uintptr_t addr, const void* src, size_t sz) {
+    if (addr < PROC_START_ADDR || addr + sz < addr
+        || addr + sz > MEMSIZE_VIRTUAL) {
+        return -1;
+    }
+    const char* s = reinterpret_cast<const char*>(src);
+    while (sz != 0) {
+        vmiter it(current, addr);
+        if (!it.perm(PTE_P | PTE_W | PTE_U)) {
+            if (!resolve_cow_fault(current, addr)
+                && !resolve_lazy_fault(current, addr)) {
+                return -1;
+            }
+            // the old read-only translation may still be cached
+            current->tlb_stale = true;
+            it.find(addr);
+            if (!it.perm(PTE_P | PTE_W | PTE_U)) {
+                return -1;
+            }
+        }
+        size_t n = min(sz, PAGESIZE - addr % PAGESIZE);
+        memcpy(it.kptr<char*>(), s, n);
+        addr += n;
+        s += n;
+        sz -= n;
+    }
+    return 0;
+}
+
+
+// collect_stats()
+//    Return a snapshot of the performance counters. (The snapshot is
+//    static because `kernel_stats` is too big for the kernel stack.)
+
+static const kernel_stats& collect_stats() {
+    static kernel_stats st;
+    st = stats;
+    for (int i = 0; i != MAXCPU; ++i) {
+        st.pagecache_hits += cpus[i].pagecache_hits;
+        st.pagecache_misses += cpus[i].pagecache_misses;
+    }
+    return st;
+}
+
+
+// syscall_getstats(addr)
+//    Copy the performance counters to `addr` in the current process.
+
+int syscall_getstats(uintptr_t addr) {
+    static_assert(SYSCALL_GETSTATS < NSTATS_SYSCALLS,
+                  "every system call needs a counter");
+    const kernel_stats& st = collect_stats();
+    return copyout(addr, &st, sizeof(st));
+}
+
+
+// syscall_log(msg)
+//    Copy the string at `msg` out of user memory and append it to the log.
+
+void syscall_log(uintptr_t msg) {
+    static_assert(SYSCALL_LOG < NSTATS_SYSCALLS,
+                  "every system call needs a counter");
+    char buf[128];
+    size_t i = 0;
+    for (vmiter it(current, msg);
+         i != sizeof(buf) - 1 && it.va() >= PROC_START_ADDR && it.user();
+         ++i, ++it) {
+        buf[i] = *it.kptr<const char*>();
+        if (buf[i] == '\0') {
+            break;
+        }
+    }
+    buf[i] = '\0';
+    log_printf("%s", buf);
+}
+
+
+#if WEENSYOS_STATSDUMP
+// stats_dump()
+//    Log the performance counters every 5 seconds.
+
+static void stats_dump() {
+    static unsigned long last_dump;
+    if (ticks - last_dump < 5 * HZ) {
+        return;
+    }
+    last_dump = ticks;
+    const kernel_stats& st = collect_stats();
+    log_printf("stats @%lu: %lu switches, %lu steals, "
+               "%lu/%lu pages alloc/free, "
+               "%lu fork shares, %lu cow copies, %lu/%lu pagecache hit/miss, "
+               "%lu reclaimed, %lu oom kills\n",
+               last_dump, st.context_switches, st.processes_stolen,
+               st.pages_allocated,
+               st.pages_freed, st.fork_pages_shared, st.cow_pages_copied,
+               st.pagecache_hits, st.pagecache_misses, st.pages_reclaimed,
+               st.oom_kills);
+    for (int i = 0; i != NSTATS_SYSCALLS; ++i) {
+        if (st.syscalls[i]) {
+            log_printf("  syscall %d: %lu calls, %lu cycles\n",
+                       i, st.syscalls[i], st.syscall_cycles[i]);
+        }
+    }
+    for (int i = 0; i != NSTATS_EXCEPTIONS; ++i) {
+        if (st.exceptions[i]) {
+            log_printf("  exception %d: %lu times, %lu cycles\n",
+                       i, st.exceptions[i], st.exception_cycles[i]);
+        }
+    }
+}
+#endif
+
+
 //syscall_exit(process)
 //  Handles the SYSCALL_EXIT system call. Frees all entries of process's pagetables,
 //  along with the tables themselves and sets the process free.
 void syscall_exit(proc* process){
+    // wake processes waiting for this one
+    while (proc* w = process->waiters) {
+        process->waiters = w->runq_next;
+        set_state(w, P_RUNNABLE);
+    }
+
     x86_64_pagetable* pt = process->pagetable;
-    for (vmiter it(pt); it.va() < MEMSIZE_VIRTUAL; it+= PAGESIZE){
-        if (it.user() && it.va() != CONSOLE_ADDR){
+    // free the per-process vDSO page (the shared one stays)
+    vmiter vit(pt, VDSO_PROC_ADDR);
+    if (vit.user()) {
+        kfree(vit.kptr());
+    }
+    // Only pages above PROC_START_ADDR belong to the process; `next()`
+    // skips unmapped regions a page table page at a time.
+    for (vmiter it(pt, PROC_START_ADDR); it.va() < MEMSIZE_VIRTUAL; it.next()){
+        if (it.user()){
             kfree((void*)it.pa());
         }
     }
@@ -353,78 +1377,165 @@ void syscall_exit(proc* process){
     }
     kfree(pt);
 
-    process->state = P_FREE;
+    set_state(process, P_FREE);
+    kfree_proc(process);
+}
+
+
+// Out-of-memory policy
+//    In kernels built with `make OOMKILL=1`, a process whose page
+//    allocation or page fault finds memory exhausted (even after
+//    `reclaim_pages`) kills the process holding the most private memory,
+//    if that is some other, larger process, and retries. Otherwise the
+//    allocation fails as usual, so the biggest consumer is the one told no.
+
+#if WEENSYOS_OOMKILL
+// private_pages(p)
+//    Return the number of pages only `p` references: the pages its exit
+//    would free. Page table pages count; pages shared by fork, text pages,
+//    and shared memory segments do not.
+
+static size_t private_pages(proc* p) {
+    size_t n = 1;               // the top-level page table
+    for (vmiter it(p, PROC_START_ADDR); it.va() < MEMSIZE_VIRTUAL; it.next()) {
+        if (it.user() && physpages[it.pa() / PAGESIZE].refcount == 1) {
+            ++n;
+        }
+    }
+    for (ptiter it(p); !it.done(); it.next()) {
+        ++n;
+    }
+    return n;
+}
+
+// unblock(p)
+//    Remove blocked process `p` from the sleeper list or from the wait
+//    queue of the process it is waiting for.
+
+static void unblock(proc* p) {
+    for (proc** pp = &sleepers; *pp; pp = &(*pp)->runq_next) {
+        if (*pp == p) {
+            *pp = p->runq_next;
+            return;
+        }
+    }
+    for (int pid = 1; pid != NPROC; ++pid) {
+        if (!ptable[pid]) {
+            continue;
+        }
+        for (proc** pp = &ptable[pid]->waiters; *pp; pp = &(*pp)->runq_next) {
+            if (*pp == p) {
+                *pp = p->runq_next;
+                return;
+            }
+        }
+    }
+}
+
+// oom_kill()
+//    Kill the process with the most private pages, if it is larger than
+//    the current process. Returns true if a process was killed.
+
+static bool oom_kill() {
+    proc* victim = nullptr;
+    size_t victim_pages = private_pages(current);
+    for (int pid = 1; pid != NPROC; ++pid) {
+        proc* p = ptable[pid];
+        if (p && !is_running(p) && p->state != P_FREE) {
+            size_t n = private_pages(p);
+            if (n > victim_pages) {
+                victim = p;
+                victim_pages = n;
+            }
+        }
+    }
+    if (!victim) {
+        return false;
+    }
+    log_printf("out of memory: killing pid %d (%zu pages) for pid %d\n",
+               victim->pid, victim_pages, current->pid);
+    if (victim->state == P_BLOCKED) {
+        unblock(victim);
+    }
+    syscall_exit(victim);
+    ++stats.oom_kills;
+    return true;
+}
+#endif
+
+// kalloc_user(zeroed)
+//    Allocate a page on behalf of the current process, as by
+//    `kalloc_zeroed` if `zeroed` is true and `kalloc` otherwise, applying
+//    the out-of-memory policy if memory is exhausted. A caller passing
+//    false must overwrite the whole page before user code can see it.
+
+void* kalloc_user(bool zeroed) {
+    while (true) {
+        void* pa = zeroed ? kalloc_zeroed() : kalloc(PAGESIZE);
+#if WEENSYOS_OOMKILL
+        if (!pa && oom_kill()) {
+            continue;
+        }
+#endif
+        return pa;
+    }
 }
 
 //syscall_fork()
 //  Handles the SYSCALL_FORK system call. Creates a child process, allocates
-//  a new page table with copies of any user writable pages from the parent,
+//  a new page table that shares the parent's user pages (writable pages are
+//  shared copy-on-write, see `resolve_cow_fault`),
 //  copies parent's register state (except for rax which is set to 0), sets process to RUNNABLE state
 //  and returns child pid on success, -1 on failure (out of memory or no more processes can be created)
 int syscall_fork(){
-    size_t pid = 0;
-    for (size_t i =1; i< NPROC; ++i){
-        if (ptable[i].state == P_FREE){
-            pid = i;
-            break;
-        }
+    proc* child = kalloc_proc();
+    if (!child){
+        return -1;
     }
-    if (pid == 0){
+    child->pagetable = kalloc_pagetable();
+    if (!child->pagetable){
+        kfree_proc(child);
         return -1;
     }
-    ptable[pid].pagetable = kalloc_pagetable();
-    if (!ptable[pid].pagetable){
+    if (copy_kernel_mappings(child->pagetable) < 0 || map_vdso(child) < 0){
+        syscall_exit(child);
         return -1;
     }
-    auto cit = vmiter(ptable[pid].pagetable);
-    for (auto pit = vmiter(current->pagetable); pit.va() < MEMSIZE_VIRTUAL; pit+=PAGESIZE){
-        if (pit.va() <PROC_START_ADDR){
-            int r = cit.try_map(pit.pa(), pit.perm());
-            if (r){
-                syscall_exit(&ptable[pid]);
-                return -1;
-            }
+    // visit only the parent's present pages
+    auto cit = vmiter(child->pagetable);
+    for (auto pit = vmiter(current, PROC_START_ADDR); pit.va() < MEMSIZE_VIRTUAL; pit.next()){
+        if (!pit.present()){
+            continue;
         }
-        else{
-            if (pit.writable() && pit.user()){
-                void* pa = kalloc(PAGESIZE);
-                if (!pa){
-                    syscall_exit(&ptable[pid]);
-                    return -1;
-                }
-                memcpy(pa, (void*) pit.pa(), PAGESIZE);
-                int r = cit.try_map((uintptr_t) pa, pit.perm());
-                if (r){
-                    syscall_exit(&ptable[pid]);
-                    return -1;
-                }
-            }
-            else if (!pit.writable() && pit.user()){
-                int r = cit.try_map(pit.pa(), pit.perm());
-                if (r){
-                    syscall_exit(&ptable[pid]);
-                    return -1;
-                }
-                if (pit.pa() != (uint64_t) -1){
-                    ++physpages[pit.pa()/PAGESIZE].refcount;
-                }
-            }
-            else{
-                int r = cit.try_map(pit.pa(), pit.perm());
-                if (r){
-                    syscall_exit(&ptable[pid]);
-                    return -1;
-                }
+        int perm = pit.perm();
+        if (pit.user()){
+            // share user pages with the child; writable pages become
+            // read-only copy-on-write pages in both processes
+            // (pages that are already copy-on-write stay as they are)
+            // (as do shared memory pages, which stay writable)
+            if ((perm & PTE_W) && !(perm & PTE_SHARED)){
+                perm = (perm & ~PTE_W) | PTE_COW;
+                pit.map(pit.pa(), perm);
+                current->tlb_stale = true;
             }
         }
-        cit+=PAGESIZE;
+        if (cit.find(pit.va()).try_map(pit.pa(), perm) < 0){
+            syscall_exit(child);
+            return -1;
+        }
+        if (pit.user()){
+            ++physpages[pit.pa()/PAGESIZE].refcount;
+            ++stats.fork_pages_shared;
+        }
     }
-    ptable[pid].regs = current->regs;
-    ptable[pid].regs.reg_rax = 0;
-    ptable[pid].pid = pid;
-    ptable[pid].state = P_RUNNABLE;
-
-    return pid;
+    child->regs = current->regs;
+    child->regs.reg_rax = 0;
+    memcpy(child->regions, current->regions, sizeof(current->regions));
+    child->program = current->program;
+    child->cpu = this_cpu()->index;
+    set_state(child, P_RUNNABLE);
+
+    return child->pid;
 }
 // syscall_page_alloc(addr)
 //    Handles the SYSCALL_PAGE_ALLOC system call. This function
@@ -439,62 +1550,329 @@ int syscall_fork(){
 //    `Addr` should be page-aligned (i.e., a multiple of PAGESIZE == 4096),
 //    >= PROC_START_ADDR, and < MEMSIZE_VIRTUAL.
 int syscall_page_alloc(uintptr_t addr) {
-    if (addr < PROC_START_ADDR || addr >= MEMSIZE_VIRTUAL || addr % 4096 != 0){
+    return syscall_page_alloc_range(addr, 1, PTE_W) == 1 ? 0 : -1;
+}
+
+// syscall_page_alloc_range(addr, npages, flags)
+//    Handles the SYSCALL_PAGE_ALLOC_RANGE system call: maps `npages` fresh
+//    zeroed pages at `[addr, addr + npages * PAGESIZE)` in a single kernel
+//    entry, freeing any memory previously mapped there. `flags` may
+//    contain `PTE_W`. Returns the number of pages mapped, which is less
+//    than `npages` if memory runs out, or -1 on invalid arguments.
+int syscall_page_alloc_range(uintptr_t addr, uintptr_t npages, int flags) {
+    if (addr < PROC_START_ADDR || addr >= MEMSIZE_VIRTUAL
+        || addr % PAGESIZE != 0
+        || npages > (MEMSIZE_VIRTUAL - addr) / PAGESIZE
+        || (flags & ~PTE_W)){
         return -1;
     }
-    auto pit = vmiter(current->pagetable);
-    void* pa = kalloc(PAGESIZE);
-    pit.find(addr);
-    if (!pa){
+    int perm = PTE_P | PTE_U | flags;
+    uintptr_t n = 0;
+    for (vmiter it(current, addr); n != npages; ++n, it += PAGESIZE){
+        void* pa = kalloc_user(true);
+        if (!pa){
+            break;
+        }
+        void* old_pa = it.user() ? it.kptr() : nullptr;
+        int r = it.try_map(pa, perm);
+        if (r){
+            kfree(pa);
+            break;
+        }
+        // drop this process's reference to any page previously mapped here
+        if (old_pa){
+            current->tlb_stale = true;
+            kfree(old_pa);
+        }
+    }
+    return n;
+}
+
+
+// syscall_mmap(addr, sz, flags)
+//    Handles the SYSCALL_MMAP system call: reserves `[addr, addr + sz)`
+//    (rounded up to whole pages) as a demand-paged region of the current
+//    process. `flags` may contain `PTE_W`. Returns 0 on success and -1 on
+//    invalid arguments, overlap with another region or with mapped pages,
+//    or if the process has no free region slots.
+int syscall_mmap(uintptr_t addr, uintptr_t sz, int flags) {
+    if (addr < PROC_START_ADDR || addr >= MEMSIZE_VIRTUAL
+        || addr % PAGESIZE != 0
+        || sz == 0 || sz > MEMSIZE_VIRTUAL - addr
+        || (flags & ~PTE_W)){
         return -1;
     }
-    int r = pit.try_map((uintptr_t)pa, PTE_P| PTE_W| PTE_U);
-    if (r){
+    uintptr_t end = addr + round_up(sz, PAGESIZE);
+    vmregion* slot = nullptr;
+    for (auto& r : current->regions){
+        if (r.start == r.end){
+            slot = slot ? slot : &r;
+        } else if (addr < r.end && r.start < end){
+            return -1;
+        }
+    }
+    if (!slot){
         return -1;
     }
-    memset((void*) pit.pa(), 0, PAGESIZE);
+    for (vmiter it(current, addr); it.va() < end; it.next()){
+        if (it.present()){
+            return -1;
+        }
+    }
+    slot->start = addr;
+    slot->end = end;
+    slot->perm = PTE_P | PTE_U | flags;
     return 0;
 }
 
 
+// runq_push(p), runq_remove(p)
+//    Add `p` to the tail of CPU `p->cpu`'s run queue, or unlink it from
+//    that queue.
+
+static void runq_push(proc* p) {
+    cpustate* c = &cpus[p->cpu];
+    p->runq_prev = c->runq_tail;
+    p->runq_next = nullptr;
+    (c->runq_tail ? c->runq_tail->runq_next : c->runq_head) = p;
+    c->runq_tail = p;
+}
+
+static void runq_remove(proc* p) {
+    cpustate* c = &cpus[p->cpu];
+    (p->runq_prev ? p->runq_prev->runq_next : c->runq_head) = p->runq_next;
+    (p->runq_next ? p->runq_next->runq_prev : c->runq_tail) = p->runq_prev;
+    p->runq_prev = p->runq_next = nullptr;
+}
+
+// is_running(p)
+//    Return true if some CPU is running `p`, or is in the kernel on its
+//    behalf.
+
+static bool is_running(proc* p) {
+    for (int i = 0; i != MAXCPU; ++i) {
+        if (cpus[i].running == p) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// steal_process(c)
+//    Move a runnable process that no CPU is running from another CPU's run
+//    queue to CPU `c`'s, and return it; or return `nullptr` if there is
+//    none. Its translations cached on `c` may be stale, so it gets a TLB
+//    flush on its next switch.
+
+static proc* steal_process(cpustate* c) {
+    for (int i = 0; i != MAXCPU; ++i) {
+        if (&cpus[i] == c) {
+            continue;
+        }
+        for (proc* p = cpus[i].runq_head; p; p = p->runq_next) {
+            if (!is_running(p)) {
+                runq_remove(p);
+                p->cpu = c->index;
+                p->tlb_stale = true;
+                runq_push(p);
+                ++stats.processes_stolen;
+                return p;
+            }
+        }
+    }
+    return nullptr;
+}
+
+
+// set_state(p, state)
+//    Set `p->state` to `state`, adding `p` to the run queue if it becomes
+//    runnable and removing it if it stops being runnable.
+
+void set_state(proc* p, int state) {
+    if (state == P_RUNNABLE && p->state != P_RUNNABLE) {
+        runq_push(p);
+    } else if (state != P_RUNNABLE && p->state == P_RUNNABLE) {
+        runq_remove(p);
+    }
+    p->state = state;
+    update_timer();
+}
+
+
+// Timer
+//
+//    By default the timer fires every 1/HZ seconds. With `TICKLESS=1`, it
+//    is instead programmed in one-shot mode for the next deadline only:
+//    the end of the current time slice when processes must take turns,
+//    otherwise the next memviewer refresh. `ticks` counts 1/HZ periods in
+//    both modes.
+
+#if WEENSYOS_TICKLESS
+#define TICK_CYCLES (1000000000 / HZ)   // timer cycles per tick
+#define TICKLESS_MAX_TICKS (HZ / 2)     // longest one-shot timeout
+static unsigned long timer_start;       // `ticks` when the timer was armed
+static uint32_t timer_carry;            // cycles of the current tick that
+                                        // had elapsed by then
+static uint32_t timer_count;            // cycles the timer was armed for
+static unsigned long timer_deadline;    // `ticks` when the timer fires
+static bool timer_armed;
+
+#endif
+
+// update_ticks()
+//    In tickless mode, advance `ticks` by the whole periods elapsed since
+//    the timer was armed. Returns the cycles elapsed in the current,
+//    partial period.
+
+static uint32_t update_ticks() {
+#if WEENSYOS_TICKLESS
+    if (timer_armed) {
+        uint64_t elapsed = timer_carry + timer_count - timer_remaining();
+        ticks = timer_start + elapsed / TICK_CYCLES;
+        vdso->ticks = ticks;
+        return elapsed % TICK_CYCLES;
+    }
+#endif
+    return 0;
+}
+
+// timer_interrupt()
+//    Account for a timer interrupt and wake processes whose sleep is over.
+
+static void timer_interrupt() {
+#if WEENSYOS_TICKLESS
+    ticks = timer_deadline;
+    timer_armed = false;
+#else
+    ++ticks;
+#endif
+    vdso->ticks = ticks;
+    while (sleepers && sleepers->wakeup_tick <= ticks) {
+        proc* p = sleepers;
+        sleepers = p->runq_next;
+        set_state(p, P_RUNNABLE);
+    }
+}
+
+// update_timer()
+//    In tickless mode, make sure the timer fires by the next deadline.
+//    Called whenever the set of runnable processes changes.
+
+static void update_timer() {
+#if WEENSYOS_TICKLESS
+    unsigned long deadline = ticks + TICKLESS_MAX_TICKS;
+    cpustate* c = this_cpu();
+    if (c->runq_head != c->runq_tail) {
+        // at least two runnable processes: preempt after one tick
+        deadline = ticks + 1;
+    }
+    if (sleepers && sleepers->wakeup_tick < deadline) {
+        deadline = sleepers->wakeup_tick;
+    }
+    if (timer_armed && timer_deadline <= deadline) {
+        return;
+    }
+    uint32_t partial = update_ticks();
+    if (deadline <= ticks) {
+        deadline = ticks + 1;
+    }
+    timer_start = ticks;
+    timer_carry = partial;
+    timer_count = (deadline - ticks) * TICK_CYCLES - partial;
+    timer_deadline = deadline;
+    timer_armed = true;
+    init_timer_oneshot(timer_count);
+#endif
+}
+
+
 // schedule
-//    Pick the next process to run and then run it.
-//    If there are no runnable processes, spins forever.
+//    Pick the next process to run on this CPU and then run it. If this
+//    CPU's run queue is empty, steals a process from another CPU's. If
+//    there are no runnable processes, zeroes free pages for
+//    `kalloc_zeroed`, then halts until the next interrupt.
 
 void schedule() {
-    pid_t pid = current->pid;
-    for (unsigned spins = 1; true; ++spins) {
-        pid = (pid + 1) % NPROC;
-        if (ptable[pid].state == P_RUNNABLE) {
-            run(&ptable[pid]);
+    cpustate* c = this_cpu();
+    while (true) {
+        // Run the process at the head of the run queue, moving it to the
+        // tail so that runnable processes take turns.
+        proc* p = c->runq_head;
+        if (!p) {
+            p = steal_process(c);
+        }
+        if (p) {
+            if (p != c->runq_tail) {
+                runq_remove(p);
+                runq_push(p);
+            }
+            run(p);
         }
 
-        // If Control-C was typed, exit the virtual machine.
-        check_keyboard();
+        // Nothing to run, so do useful idle work; once there is none
+        // left, sleep until an interrupt (the timer or a keypress). Other
+        // CPUs may use the kernel meanwhile.
+        current = nullptr;
+        stats_stop();
+        if (!refill_zeroed_pages()) {
+            update_timer();
+            log_flush();
+            kernel_lock.unlock();
+            asm volatile("sti; hlt; cli" : : : "memory");
+            kernel_lock.lock();
+            if (c == &cpus[0]) {
+                memshow();
+            }
+        }
 
-        // If spinning forever, show the memviewer.
-        if (spins % (1 << 12) == 0) {
-            memshow();
-            log_printf("%u\n", spins);
+        // If Control-C was typed, exit the virtual machine.
+        if (c == &cpus[0]) {
+            check_keyboard();
         }
     }
 }
 
 
+// process_cr3(p)
+//    Each process's PCID is its pid; the kernel page table uses PCID 0.
+
+uintptr_t process_cr3(proc* p) {
+    uintptr_t cr3 = kptr2pa(p->pagetable);
+    if (cr3_noflush) {
+        cr3 |= p->pcid | (p->tlb_stale ? 0 : cr3_noflush);
+        p->tlb_stale = false;
+    }
+    return cr3;
+}
+
+
 // run(p)
-//    Run process `p`. This involves setting `current = p` and calling
-//    `exception_return` to restore its page table and registers.
+//    Run process `p` on this CPU. This involves setting `current = p`,
+//    releasing the kernel lock, and calling `exception_return` to restore
+//    its page table and registers.
 
 void run(proc* p) {
     assert(p->state == P_RUNNABLE);
-    current = p;
+    cpustate* c = this_cpu();
+    if (p != c->running) {
+        ++stats.context_switches;
+    }
+    stats_stop();
+    c->running = p;
+    c->current_pid = p->pid;
 
-    // Check the process's current pagetable.
+#ifndef NDEBUG
+    // Check the process's current pagetable. This costs three page table
+    // walks per context switch, so `NDEBUG` builds skip it.
     check_pagetable(p->pagetable);
+#endif
 
     // This function is defined in k-exception.S. It restores the process's
     // registers then jumps back to user mode.
-    exception_return(p);
+    update_timer();
+    uintptr_t cr3 = process_cr3(p);
+    kernel_lock.unlock();
+    exception_return(p, cr3, c->kstack_top);
 
     // should never get here
     while (true) {
@@ -506,7 +1884,12 @@ void run(proc* p) {
 //    Draw a picture of memory (physical and virtual) on the CGA console.
 //    Switches to a new process's virtual memory map every 0.25 sec.
 //    Uses `console_memviewer()`, a function defined in `k-memviewer.cc`.
+//    Headless builds (`make HEADLESS=1`) compile the memory viewer out.
 
+#if WEENSYOS_HEADLESS
+void memshow() {
+}
+#else
 void memshow() {
     static unsigned last_ticks = 0;
     static int showing = 0;
@@ -519,9 +1902,10 @@ void memshow() {
 
     proc* p = nullptr;
     for (int search = 0; !p && search < NPROC; ++search) {
-        if (ptable[showing].state != P_FREE
-            && ptable[showing].pagetable) {
-            p = &ptable[showing];
+        if (ptable[showing]
+            && ptable[showing]->state != P_FREE
+            && ptable[showing]->pagetable) {
+            p = ptable[showing];
         } else {
             showing = (showing + 1) % NPROC;
         }
@@ -534,3 +1918,4 @@ void memshow() {
             "\n\n\n\n\n\n\n\n\n\n\n");
     }
 }
+#endif
@@ -2,6 +2,7 @@
 #define WEENSYOS_KERNEL_HH
 #include "x86-64.h"
 #include "lib.hh"
+#include <atomic>
 #if WEENSYOS_PROCESS
 #error "kernel.hh should not be used by process code."
 #endif
@@ -21,6 +22,16 @@ struct program_image_segment;
 #define P_BLOCKED   2                   // blocked process
 #define P_FAULTED   3                   // faulted process
 
+// Demand-paged virtual memory region (see `sys_mmap`). Pages in
+// `[start, end)` are allocated and zeroed on first touch.
+struct vmregion {
+    uintptr_t start = 0;                // first address
+    uintptr_t end = 0;                  // one past last address; empty if
+                                        // `start == end`
+    int perm = 0;                       // permissions for new pages
+};
+#define NVMREGIONS 8
+
 // Process descriptor type
 struct proc {
     x86_64_pagetable* pagetable;        // process's page table
@@ -28,11 +39,123 @@ struct proc {
     int state;                          // process state (see above)
     regstate regs;                      // process's current registers
     // The first 4 members of `proc` must not change, but you can add more.
+    vmregion regions[NVMREGIONS];       // demand-paged regions
+    proc* runq_prev = nullptr;          // run queue links (only valid while
+    proc* runq_next = nullptr;          // `state == P_RUNNABLE`; `runq_next`
+                                        // also links free descriptors and
+                                        // blocked processes' wait queues)
+    unsigned long wakeup_tick = 0;      // `sys_sleep` deadline
+    proc* waiters = nullptr;            // processes blocked in `sys_waitpid`
+                                        // for this one
+    int program = -1;                   // program image number
+    int cpu = 0;                        // index of the CPU whose run queue
+                                        // holds it (or held it last)
+    uint16_t pcid = 0;                  // TLB tag for this address space
+    bool tlb_stale = true;              // set when the kernel changes or
+                                        // removes a present mapping; the
+                                        // next switch flushes `pcid`
+};
+
+// Process table: `ptable[pid]` points to process `pid`'s descriptor, or is
+// nullptr if `pid` is unused. Descriptors are slab-allocated, so the number
+// of processes is limited by memory; `NPROC` only bounds process IDs.
+#define NPROC 512               // maximum number of process IDs
+extern proc* ptable[NPROC];
+
+
+// spinlock
+//    A test-and-test-and-set lock for data shared between CPUs. Kernel code
+//    runs with interrupts disabled, so a holder is never preempted.
+struct spinlock {
+    std::atomic<bool> locked_ = false;
+
+    inline void lock() {
+        while (locked_.exchange(true, std::memory_order_acquire)) {
+            while (locked_.load(std::memory_order_relaxed)) {
+                pause();
+            }
+        }
+    }
+    inline void unlock() {
+        locked_.store(false, std::memory_order_release);
+    }
 };
 
-// Process table
-#define NPROC 16                // maximum number of processes
-extern proc ptable[NPROC];
+// spinlock_guard
+//    Holds a spinlock for the lifetime of the guard object.
+struct spinlock_guard {
+    spinlock& lock_;
+    explicit spinlock_guard(spinlock& lock)
+        : lock_(lock) {
+        lock_.lock();
+    }
+    ~spinlock_guard() {
+        lock_.unlock();
+    }
+    NO_COPY_OR_ASSIGN(spinlock_guard);
+};
+
+
+// Per-CPU state. The boot CPU is `cpus[0]`; `init_other_cpus` starts the
+// application processors, which claim the following slots in arrival
+// order. Each CPU has its own kernel stack, task state segment, running
+// process, and run queue (see `schedule` in kernel.cc).
+#define MAXCPU 8                // maximum number of CPUs
+#define PAGECACHE_SIZE 32       // free pages cached per CPU (see `kalloc`)
+
+// offsets of the `cpustate` members `syscall_entry` reads through %gs
+#define CPUSTATE_KSTACK_TOP     0
+#define CPUSTATE_USER_RSP       8
+#define CPUSTATE_CURRENT_PID    16
+
+struct cpustate {
+    // The first 3 members are used by `syscall_entry`; don't move them.
+    uintptr_t kstack_top = 0;           // top of this CPU's kernel stack
+    uintptr_t user_rsp = 0;             // `syscall_entry` scratch space
+    pid_t current_pid = 0;              // `running->pid`, for `sys_getpid`
+    int index = -1;                     // index in `cpus`
+    uint32_t lapic_id = 0;              // local APIC ID
+
+    proc* running = nullptr;            // process this CPU is running
+                                        // (`current` in kernel.cc)
+    proc* runq_head = nullptr;          // runnable processes, in the order
+    proc* runq_tail = nullptr;          // this CPU will run them
+
+    // free pages owned by this CPU (see `kalloc`)
+    void* pagecache[PAGECACHE_SIZE];
+    int npagecache = 0;
+    unsigned long pagecache_hits = 0;   // allocations served by the cache
+    unsigned long pagecache_misses = 0; // allocations that had to refill it
+
+    uint64_t gdt_segments[7];           // segment descriptors, including
+    x86_64_taskstate taskstate;         // this task state segment, which
+                                        // gives interrupts `kstack_top`
+};
+extern cpustate cpus[MAXCPU];
+extern std::atomic<int> ncpu;           // number of CPUs that are up
+
+// this_cpu()
+//    Return the state of the CPU running this code. Each CPU runs on its
+//    own kernel stack page, so this is found from %rsp.
+inline cpustate* this_cpu() {
+    uintptr_t stack_top = round_down(rdrsp(), PAGESIZE) + PAGESIZE;
+    for (int i = 0; i != MAXCPU; ++i) {
+        if (cpus[i].kstack_top == stack_top) {
+            return &cpus[i];
+        }
+    }
+    return &cpus[0];
+}
+
+// init_other_cpus()
+//    Start the application processors with the INIT/SIPI sequence and wait
+//    for them to check in. Called once by the boot CPU.
+void init_other_cpus();
+
+// ap_kernel_start()
+//    Called on each application processor once its hardware is set up.
+//    Defined in kernel.cc; runs processes and never returns.
+[[noreturn]] void ap_kernel_start();
 
 
 // Kernel start address
@@ -56,15 +179,21 @@ extern proc ptable[NPROC];
 //
 //    `physpages[I]` is a `physpageinfo` structure corresponding to the `I`th
 //    physical page (which contains physical addresses
-//    `[I*PAGESIZE,(I+1)*PAGESIZE)`). In the handout code,
-//    `physpages[I].refcount` represents the number of times physical page `I`
-//    is used. Free pages have `refcount == 0`, and (since handout processes
-//    never share memory) allocated pages have `refcount == 1`.
+//    `[I*PAGESIZE,(I+1)*PAGESIZE)`). `physpages[I].refcount` represents
+//    the number of times physical page `I` is used. Free pages have
+//    `refcount == 0`. Shared pages (copy-on-write pages and cached program
+//    text) count each mapping, plus one for the program text cache. Like
+//    all kernel data, `refcount` is protected by the kernel lock, so it is
+//    updated with plain operations.
 //
 //    You can add more information to `physpageinfo` if you need to, but the
 //    memory viewer relies on `refcount == 0` indicating free pages.
+//
+//    Free allocatable pages are linked through `next_free` into the
+//    allocator's free list (see `kalloc` in kernel.cc).
 struct physpageinfo {
-    uint8_t refcount = 0;
+    uint16_t refcount = 0;
+    physpageinfo* next_free = nullptr;  // next page on the free list
 
     bool used() const {
         return this->refcount != 0;
@@ -73,13 +202,27 @@ struct physpageinfo {
 };
 extern physpageinfo physpages[NPAGES];
 
+// PTE_COW
+//    Software page table bit marking a copy-on-write mapping. Such pages
+//    are mapped read-only and possibly shared (`refcount > 1`); the first
+//    write faults and gives the writer a private copy.
+#define PTE_COW                 PTE_OS1
+
+// PTE_SHARED
+//    Software page table bit marking a shared memory mapping (see
+//    `sys_shm_map`). `fork` shares such pages writable rather than making
+//    them copy-on-write.
+#define PTE_SHARED              PTE_OS2
+
 
 // Segment selectors
 #define SEGSEL_BOOT_CODE        0x8             // boot code segment
 #define SEGSEL_KERN_CODE        0x8             // kernel code segment
 #define SEGSEL_KERN_DATA        0x10            // kernel data segment
-#define SEGSEL_APP_CODE         0x18            // application code segment
-#define SEGSEL_APP_DATA         0x20            // application data segment
+#define SEGSEL_APP_DATA         0x18            // application data segment
+#define SEGSEL_APP_CODE         0x20            // application code segment
+// (`sysretq` requires the application code segment to directly follow
+// the application data segment.)
 #define SEGSEL_TASKSTATE        0x28            // task state segment
 
 
@@ -102,10 +245,29 @@ void init_hardware();
 //    timer interrupt if `rate <= 0`.
 void init_timer(int rate);
 
+// init_timer_oneshot(count)
+//    Set the timer interrupt to fire once, `count` timer cycles from now
+//    (there are 10^9 timer cycles a second). Disables the timer interrupt
+//    if `count == 0`.
+void init_timer_oneshot(uint32_t count);
+
+// timer_remaining()
+//    Return the number of timer cycles left before a one-shot timer fires.
+uint32_t timer_remaining();
+
+// measure_tsc_hz()
+//    Return the TSC frequency in Hz, measured against the timer. Leaves
+//    the timer interrupt disabled.
+uint64_t measure_tsc_hz();
+
 
 void* kalloc(size_t sz);
 void kfree(void* ptr);
 
+// kalloc_zeroed
+//    Allocate one zero-filled page, or return `nullptr` on failure.
+void* kalloc_zeroed();
+
 
 // kernel page table (used for virtual memory)
 extern x86_64_pagetable kernel_pagetable[];
@@ -124,7 +286,8 @@ x86_64_pagetable* kalloc_pagetable();
 
 // check_pagetable
 //    Validate a page table by checking that important kernel procedures
-//    are mapped at the expected addresses.
+//    are mapped at the expected addresses. `run` calls this on every
+//    context switch unless the kernel is built with `NDEBUG`.
 void check_pagetable(x86_64_pagetable* pagetable);
 
 // set_pagetable
@@ -146,10 +309,23 @@ void exception_entry();
 //    `k-exception.S`; “called” only by hardware.
 void syscall_entry();
 
-// exception_return
+// exception_return(p, cr3, stack_top)
 //    Return from an exception to user mode: load the page table
 //    and registers and start the process back up. Defined in k-exception.S.
-[[noreturn]] void exception_return(proc* p);
+//    `cr3` is the %cr3 value for `p`, as returned by `process_cr3(p)`, and
+//    `stack_top` is the top of this CPU's kernel stack.
+[[noreturn]] void exception_return(proc* p, uintptr_t cr3,
+                                   uintptr_t stack_top);
+
+// process_cr3(p)
+//    Return the %cr3 value that switches to `p`'s page table. If the CPU
+//    supports PCIDs, `p`'s cached translations survive the switch unless
+//    `p->tlb_stale` is set.
+uintptr_t process_cr3(proc* p);
+
+// cr3_noflush
+//    `CR3_NOFLUSH` if PCIDs are enabled, 0 otherwise.
+extern uint64_t cr3_noflush;
 
 
 // console_show_cursor(cpos)
@@ -183,10 +359,10 @@ int keyboard_readc();
 #define KEY_DELETE      0311
 
 // check_keyboard
-//    Check for the user typing a control key. 'a', 'f', and 'e' cause a soft
-//    reboot where the kernel runs the allocator programs, "fork", or
-//    "forkexit", respectively. Control-C or 'q' exit the virtual machine.
-//    Returns key typed or -1 for no key.
+//    Check for the user typing a control key. 'a', 'f', 'e', and 'm' cause a
+//    soft reboot where the kernel runs the allocator programs, "fork",
+//    "forkexit", or "membench", respectively. Control-C or 'q' exit the
+//    virtual machine. Returns key typed or -1 for no key.
 int check_keyboard();
 
 
@@ -208,6 +384,7 @@ struct program_image {
     program_image(int program_number);
     program_image(const char* program_name);
     static int program_number(const char* program_name);
+    static const char* program_name(int program_number);
 
     // Return true iff this program image is empty (has no data).
     bool empty() const;
@@ -220,6 +397,11 @@ struct program_image {
     // Return the user virtual address of the entry point instruction.
     uintptr_t entry() const;
 
+    // Look up the function containing user address `addr` in the image's
+    // symbol table, as for `lookup_symbol`. Returns true if found.
+    bool lookup_symbol(uintptr_t addr, const char** name,
+                       uintptr_t* start) const;
+
   private:
     elf_header* elf_;
 };
@@ -276,6 +458,12 @@ struct program_image_segment {
 __noinline void log_printf(const char* format, ...);
 __noinline void log_vprintf(const char* format, va_list val);
 
+// log_flush
+//    Write buffered log messages to `log.txt`. `log_printf` only buffers;
+//    the kernel flushes from the idle loop and the timer interrupt, and
+//    before it fails, reboots, or powers off.
+void log_flush();
+
 // log_backtrace
 //    Print a backtrace to the host's `log.txt` file, either for the current
 //    stack or for a given stack range.
@@ -290,6 +478,14 @@ __no_asan
 bool lookup_symbol(uintptr_t addr, const char** name, uintptr_t* start);
 
 
+// profile_sample(rip, p), profile_dump()
+//    Sampling profiler (`make PROFILE=1`; see `k-profile.cc`).
+//    `profile_sample` records a timer interrupt at `rip` in process `p`
+//    (`nullptr` for the kernel). `profile_dump` logs the hottest functions.
+void profile_sample(uintptr_t rip, const proc* p);
+void profile_dump();
+
+
 // error_vprintf, error_printf
 //    Print debugging messages to the console and to the host's
 //    `log.txt` file via `log_printf`.
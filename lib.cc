@@ -15,9 +15,30 @@ extern "C" {
 // strncmp, strchr, strtoul, strtol
 //    We must provide our own implementations.
 
+// The memory kernels move 8-byte words; x86-64 allows unaligned word
+// accesses. Large buffers use `rep movsq`/`rep stosq` after aligning the
+// destination. (SSE is unavailable: the kernel and processes are built
+// with `-mno-sse` and no FPU state is saved on context switch.)
+
+typedef uint64_t __attribute__((may_alias, aligned(1))) memword_t;
+#define MEM_REP_THRESHOLD       256
+
 void* memcpy(void* dst, const void* src, size_t n) {
     const char* s = (const char*) src;
-    for (char* d = (char*) dst; n > 0; --n, ++s, ++d) {
+    char* d = (char*) dst;
+    if (n >= MEM_REP_THRESHOLD) {
+        for (; (uintptr_t) d % 8 != 0; --n) {
+            *d++ = *s++;
+        }
+        size_t nw = n / 8;
+        asm volatile("rep movsq" : "+D" (d), "+S" (s), "+c" (nw)
+                     : : "memory");
+        n %= 8;
+    }
+    for (; n >= 8; n -= 8, s += 8, d += 8) {
+        *(memword_t*) d = *(const memword_t*) s;
+    }
+    for (; n > 0; --n, ++s, ++d) {
         *d = *s;
     }
     return dst;
@@ -28,19 +49,36 @@ void* memmove(void* dst, const void* src, size_t n) {
     char* d = (char*) dst;
     if (s < d && s + n > d) {
         s += n, d += n;
+        for (; n >= 8; n -= 8) {
+            s -= 8, d -= 8;
+            *(memword_t*) d = *(const memword_t*) s;
+        }
         while (n-- > 0) {
             *--d = *--s;
         }
+        return dst;
     } else {
-        while (n-- > 0) {
-            *d++ = *s++;
-        }
+        // a forward copy is safe when `d <= s`
+        return memcpy(dst, src, n);
     }
-    return dst;
 }
 
 void* memset(void* v, int c, size_t n) {
-    for (char* p = (char*) v; n > 0; ++p, --n) {
+    char* p = (char*) v;
+    uint64_t w = 0x0101010101010101UL * (unsigned char) c;
+    if (n >= MEM_REP_THRESHOLD) {
+        for (; (uintptr_t) p % 8 != 0; --n) {
+            *p++ = c;
+        }
+        size_t nw = n / 8;
+        asm volatile("rep stosq" : "+D" (p), "+c" (nw) : "a" (w)
+                     : "memory");
+        n %= 8;
+    }
+    for (; n >= 8; n -= 8, p += 8) {
+        *(memword_t*) p = w;
+    }
+    for (; n > 0; ++p, --n) {
         *p = c;
     }
     return v;
@@ -49,6 +87,10 @@ void* memset(void* v, int c, size_t n) {
 int memcmp(const void* a, const void* b, size_t n) {
     const uint8_t* sa = reinterpret_cast<const uint8_t*>(a);
     const uint8_t* sb = reinterpret_cast<const uint8_t*>(b);
+    // skip equal words, then find the differing byte
+    for (; n >= 8 && *(const memword_t*) sa == *(const memword_t*) sb;
+         sa += 8, sb += 8, n -= 8) {
+    }
     for (; n > 0; ++sa, ++sb, --n) {
         if (*sa != *sb) {
             return (*sa > *sb) - (*sa < *sb);
@@ -274,6 +316,24 @@ constexpr char printfmt<long>::spec[];
 constexpr char printfmt<unsigned long>::spec[];
 
 
+// memcpy_page, memzero_page
+//    Copy or zero one page. Both arguments must be page-aligned.
+
+void memcpy_page(void* dst, const void* src) {
+    assert((uintptr_t) dst % PAGESIZE == 0 && (uintptr_t) src % PAGESIZE == 0);
+    size_t nw = PAGESIZE / 8;
+    asm volatile("rep movsq" : "+D" (dst), "+S" (src), "+c" (nw)
+                 : : "memory");
+}
+
+void memzero_page(void* dst) {
+    assert((uintptr_t) dst % PAGESIZE == 0);
+    size_t nw = PAGESIZE / 8;
+    asm volatile("rep stosq" : "+D" (dst), "+c" (nw) : "a" (0UL)
+                 : "memory");
+}
+
+
 // printer::vprintf
 //    Format and print a string into a generic printer object.
 
@@ -295,6 +355,12 @@ static char* fill_numbuf(char* numbuf_end, unsigned long val, int base) {
     return numbuf_end;
 }
 
+void printer::write(const char* s, size_t len, int color) {
+    for (; len > 0; ++s, --len) {
+        putc(*s, color);
+    }
+}
+
 #define FLAG_ALT                (1<<0)
 #define FLAG_ZERO               (1<<1)
 #define FLAG_LEFTJUSTIFY        (1<<2)
@@ -313,7 +379,11 @@ void printer::vprintf(int color, const char* format, va_list val) {
 
     for (; *format; ++format) {
         if (*format != '%') {
-            putc(*format, color);
+            // print the literal text up to the next conversion in one go
+            const char* pct = strchr(format, '%');
+            size_t len = pct ? pct - format : strlen(format);
+            write(format, len, color);
+            format += len - 1;
             continue;
         }
 
@@ -464,15 +534,13 @@ void printer::vprintf(int color, const char* format, va_list val) {
         for (; !(flags & FLAG_LEFTJUSTIFY) && width > 0; --width) {
             putc(' ', color);
         }
-        for (; *prefix; ++prefix) {
-            putc(*prefix, color);
+        if (*prefix) {
+            puts(prefix, color);
         }
         for (; zeros > 0; --zeros) {
             putc('0', color);
         }
-        for (; datalen > 0; ++data, --datalen) {
-            putc(*data, color);
-        }
+        write(data, datalen, color);
         for (; width > 0; --width) {
             putc(' ', color);
         }
@@ -496,6 +564,12 @@ struct string_printer : public printer {
         }
         ++n_;
     }
+    void write(const char* s, size_t len, int) override {
+        size_t n = min(len, size_t(end_ - s_));
+        memcpy(s_, s, n);
+        s_ += n;
+        n_ += len;
+    }
 };
 
 ssize_t vsnprintf(char* s, size_t size, const char* format, va_list val) {
@@ -537,6 +611,7 @@ struct console_printer : public printer {
     bool scroll_;
     console_printer(int cpos, bool scroll);
     inline void putc(unsigned char c, int color) override;
+    void write(const char* s, size_t len, int color) override;
     void scroll();
     void move_cursor();
 };
@@ -589,14 +664,35 @@ inline void console_printer::putc(unsigned char c, int color) {
     }
 }
 
+// console_printer::write(s, len, color)
+//    Copy a run of characters straight into console cells, stopping only
+//    for newlines and scrolling.
+void console_printer::write(const char* s, size_t len, int color) {
+    uint16_t* const console_end = console + CONSOLE_ROWS * CONSOLE_COLUMNS;
+    while (len > 0) {
+        while (cell_ >= console_end) {
+            scroll();
+        }
+        size_t n = min(len, size_t(console_end - cell_));
+        size_t i = 0;
+        for (; i != n && s[i] != '\n'; ++i) {
+            cell_[i] = (unsigned char) s[i] | color;
+        }
+        cell_ += i;
+        s += i;
+        len -= i;
+        if (len > 0 && *s == '\n') {
+            console_printer::putc('\n', color);
+            ++s;
+            --len;
+        }
+    }
+}
+
 __noinline
 int console_puts(int cpos, int color, const char* s, size_t len) {
     console_printer cp(cpos, cpos < 0);
-    while (len > 0) {
-        cp.putc(*s, color);
-        ++s;
-        --len;
-    }
+    cp.write(s, len, color);
     if (cpos < 0) {
         cp.move_cursor();
     }
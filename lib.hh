@@ -40,6 +40,12 @@ inline int tolower(int c);
 inline int toupper(int c);
 }
 
+// memcpy_page(dst, src), memzero_page(dst)
+//    Copy or zero one PAGESIZE-byte page. `dst` and `src` must be
+//    page-aligned; these are faster than general `memcpy`/`memset`.
+void memcpy_page(void* dst, const void* src);
+void memzero_page(void* dst);
+
 #define RAND_MAX 0x7FFFFFFF
 int rand();
 void srand(unsigned seed);
@@ -210,6 +216,60 @@ inline uint32_t crc32c(const void* buf, size_t sz) {
 #define SYSCALL_PAGE_ALLOC      4
 #define SYSCALL_FORK            5
 #define SYSCALL_EXIT            6
+#define SYSCALL_PAGE_ALLOC_RANGE 7
+#define SYSCALL_MMAP            8
+#define SYSCALL_SLEEP           9
+#define SYSCALL_WAITPID         10
+#define SYSCALL_EXEC            11
+#define SYSCALL_SHM_CREATE      12
+#define SYSCALL_SHM_MAP         13
+#define SYSCALL_GETSTATS        14
+#define SYSCALL_LOG             15
+
+
+// Kernel performance counters, as returned by `sys_getstats`. A system
+// call or exception is charged the TSC cycles from kernel entry until the
+// kernel returns to user mode or goes idle, including any scheduling.
+// (`sys_getpid`'s fast path is not counted.)
+
+#define NSTATS_SYSCALLS         16      // system call numbers counted
+#define NSTATS_EXCEPTIONS       64      // exception vectors counted
+
+struct kernel_stats {
+    unsigned long syscalls[NSTATS_SYSCALLS];
+    unsigned long syscall_cycles[NSTATS_SYSCALLS];
+    unsigned long exceptions[NSTATS_EXCEPTIONS];
+    unsigned long exception_cycles[NSTATS_EXCEPTIONS];
+    unsigned long context_switches;     // `run`s of a different process
+    unsigned long processes_stolen;     // moves to an idle CPU's run queue
+    unsigned long pages_allocated;      // pages taken off the free lists
+    unsigned long pages_freed;          // pages put back
+    unsigned long fork_pages_shared;    // pages `fork` shared with a child
+    unsigned long cow_pages_copied;     // copy-on-write faults that copied
+    unsigned long pagecache_hits;       // `kalloc`s served by the per-CPU
+    unsigned long pagecache_misses;     // page cache, and those that weren't
+    unsigned long pages_reclaimed;      // cached pages `kalloc` took back
+    unsigned long oom_kills;            // processes killed for memory
+};
+
+
+// vDSO pages: read-only kernel data mapped into every process, so user
+// code can read it without a system call (see `vdso_getpid` in u-lib.hh).
+// `VDSO_ADDR` is one page shared by all processes; `VDSO_PROC_ADDR` is a
+// separate page per process.
+
+#define VDSO_ADDR               0xFE000
+#define VDSO_PROC_ADDR          0xFF000
+
+struct vdso_data {
+    volatile unsigned long ticks;       // timer ticks since boot
+    unsigned hz;                        // timer ticks per second
+    unsigned long tsc_hz;               // TSC ticks per second
+};
+
+struct vdso_proc_data {
+    pid_t pid;                          // process ID
+};
 
 
 // CGA console printing
@@ -276,9 +336,17 @@ void console_printf(const char* format, ...);
 
 struct printer {
     virtual void putc(unsigned char c, int color) = 0;
+    // Print `len` bytes from `s`. Printers that can copy a run of bytes
+    // at once should override this; the default calls `putc` per byte.
+    virtual void write(const char* s, size_t len, int color);
+    inline void puts(const char* s, int color);
     void vprintf(int color, const char* format, va_list val);
 };
 
+inline void printer::puts(const char* s, int color) {
+    write(s, strlen(s), color);
+}
+
 
 // error_printf(cursor, color, format, ...)
 //    Like `console_printf`, but `color` defaults to `COLOR_ERROR`, and
@@ -45,8 +45,8 @@ void process_main() {
         sys_yield();
     }
 
-    // After running out of memory, do nothing forever
+    // After running out of memory, do nothing forever without using CPU
     while (true) {
-        sys_yield();
+        sys_sleep(100);
     }
 }
@@ -0,0 +1,139 @@
+#include "u-lib.hh"
+
+// p-bench.cc
+//
+//    Benchmark suite for the kernel's hot paths: system calls, fork, page
+//    allocation, and context switches. Each benchmark times NTRIALS
+//    operations with `rdtsc` and reports the median and 99th percentile
+//    in TSC cycles, both on the console and in `log.txt`. Type 'b' to run
+//    it, or use `make bench` to run it headless and collect the results.
+
+extern uint8_t end[];
+
+#define NTRIALS 255
+
+static uint64_t trials[NTRIALS];
+
+static int report_cpos = CPOS(23, 0);
+
+// report(name)
+//    Sort `trials` and report its median and 99th percentile as benchmark
+//    `name`. The console gets a short form on the bottom two rows, below
+//    the memory viewer.
+static void report(const char* name) {
+    // insertion sort is fine for a few hundred samples
+    for (int i = 1; i != NTRIALS; ++i) {
+        uint64_t t = trials[i];
+        int j = i;
+        for (; j > 0 && trials[j - 1] > t; --j) {
+            trials[j] = trials[j - 1];
+        }
+        trials[j] = t;
+    }
+    char buf[80];
+    snprintf(buf, sizeof(buf), "bench %-10s median %8lu  p99 %8lu cycles\n",
+             name, trials[NTRIALS / 2], trials[NTRIALS * 99 / 100]);
+    sys_log(buf);
+    report_cpos = console_printf(report_cpos, 0x0F00, "%s %lu/%lu  ", name,
+                                 trials[NTRIALS / 2],
+                                 trials[NTRIALS * 99 / 100]);
+}
+
+// bench_syscall()
+//    `sys_getpid` takes the kernel's fast path; `sys_waitpid` on our own
+//    pid fails at once, so it measures a full trip through `syscall()`.
+static void bench_syscall() {
+    for (int i = 0; i != NTRIALS; ++i) {
+        uint64_t t0 = rdtsc();
+        (void) sys_getpid();
+        trials[i] = rdtsc() - t0;
+    }
+    report("getpid");
+
+    pid_t self = sys_getpid();
+    for (int i = 0; i != NTRIALS; ++i) {
+        uint64_t t0 = rdtsc();
+        (void) sys_waitpid(self);
+        trials[i] = rdtsc() - t0;
+    }
+    report("syscall");
+}
+
+// bench_fork()
+//    Time `sys_fork` as seen by the parent. Each child exits immediately
+//    and is reaped outside the timed region.
+static void bench_fork() {
+    for (int i = 0; i != NTRIALS; ++i) {
+        uint64_t t0 = rdtsc();
+        pid_t p = sys_fork();
+        if (p == 0) {
+            sys_exit();
+        }
+        trials[i] = rdtsc() - t0;
+        if (p < 0) {
+            panic("bench: fork failed\n");
+        }
+        sys_waitpid(p);
+    }
+    report("fork");
+}
+
+// bench_pagealloc(page)
+//    Time `sys_page_alloc` at a fixed address; each call frees the page
+//    the previous call mapped there.
+static void bench_pagealloc(uint8_t* page) {
+    for (int i = 0; i != NTRIALS; ++i) {
+        uint64_t t0 = rdtsc();
+        int r = sys_page_alloc(page);
+        trials[i] = rdtsc() - t0;
+        if (r < 0) {
+            panic("bench: page allocation failed\n");
+        }
+    }
+    report("pagealloc");
+}
+
+// bench_ctxswitch(shared)
+//    Fork a child that yields until told to stop, then time `sys_yield`
+//    round trips between the two. Each round trip is two switches. The
+//    stop flag lives in shared memory, which fork does not copy.
+static void bench_ctxswitch(uint8_t* shared) {
+    int id = sys_shm_create(PAGESIZE);
+    if (id < 0 || sys_shm_map(id, shared) < 0) {
+        panic("bench: cannot map shared memory\n");
+    }
+    volatile int* done = reinterpret_cast<volatile int*>(shared);
+    pid_t p = sys_fork();
+    if (p == 0) {
+        while (!*done) {
+            sys_yield();
+        }
+        sys_exit();
+    } else if (p < 0) {
+        panic("bench: fork failed\n");
+    }
+    for (int i = 0; i != NTRIALS; ++i) {
+        uint64_t t0 = rdtsc();
+        sys_yield();
+        trials[i] = (rdtsc() - t0) / 2;
+    }
+    *done = 1;
+    sys_waitpid(p);
+    report("ctxswitch");
+}
+
+void process_main() {
+    uint8_t* page = (uint8_t*) round_up((uintptr_t) end, PAGESIZE);
+    report_cpos = console_printf(report_cpos, 0x0F00,
+                                 "cycles median/p99: ");
+
+    bench_syscall();
+    bench_fork();
+    bench_pagealloc(page);
+    bench_ctxswitch(page + PAGESIZE);
+    sys_log("bench done\n");
+
+    while (true) {
+        sys_sleep(100);
+    }
+}
@@ -0,0 +1,80 @@
+#include "u-lib.hh"
+
+// p-membench.cc
+//
+//    Microbenchmark for the memory kernels in lib.cc. Reports the median
+//    number of TSC cycles spent per 4 KiB page by each kernel.
+
+extern uint8_t end[];
+
+#define NTRIALS 255
+
+static uint64_t trials[NTRIALS];
+
+// time_page_op(f)
+//    Run `f` NTRIALS times and return the median cycle count.
+template <typename F>
+static unsigned long time_page_op(F f) {
+    for (int i = 0; i != NTRIALS; ++i) {
+        uint64_t t0 = rdtsc();
+        f();
+        trials[i] = rdtsc() - t0;
+    }
+    // insertion sort is fine for a few hundred samples
+    for (int i = 1; i != NTRIALS; ++i) {
+        uint64_t t = trials[i];
+        int j = i;
+        for (; j > 0 && trials[j - 1] > t; --j) {
+            trials[j] = trials[j - 1];
+        }
+        trials[j] = t;
+    }
+    return trials[NTRIALS / 2];
+}
+
+void process_main() {
+    uint8_t* src = (uint8_t*) round_up((uintptr_t) end, PAGESIZE);
+    uint8_t* dst = src + PAGESIZE;
+    if (sys_page_alloc(src) < 0 || sys_page_alloc(dst) < 0) {
+        panic("membench: cannot allocate pages\n");
+    }
+    memset(src, 0x61, PAGESIZE);
+
+    unsigned long bytewise = time_page_op([&] () {
+            volatile uint8_t* d = dst;
+            for (size_t i = 0; i != PAGESIZE; ++i) {
+                d[i] = src[i];
+            }
+        });
+    unsigned long copy = time_page_op([&] () {
+            memcpy(dst, src, PAGESIZE);
+        });
+    unsigned long copy_unaligned = time_page_op([&] () {
+            memcpy(dst + 1, src, PAGESIZE - 1);
+        });
+    unsigned long copy_page = time_page_op([&] () {
+            memcpy_page(dst, src);
+        });
+    unsigned long set = time_page_op([&] () {
+            memset(dst, 0, PAGESIZE);
+        });
+    unsigned long zero_page = time_page_op([&] () {
+            memzero_page(dst);
+        });
+    memcpy_page(dst, src);
+    unsigned long cmp = time_page_op([&] () {
+            assert(memcmp(dst, src, PAGESIZE) == 0);
+        });
+
+    console_printf(CPOS(23, 0), 0x0F00,
+                   "cycles/page: bytes %lu  memcpy %lu  unaligned %lu"
+                   "  memcpy_page %lu\n", bytewise, copy, copy_unaligned,
+                   copy_page);
+    console_printf(CPOS(24, 0), 0x0F00,
+                   "             memset %lu  memzero_page %lu  memcmp %lu\n",
+                   set, zero_page, cmp);
+
+    while (true) {
+        sys_sleep(100);
+    }
+}
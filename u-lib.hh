@@ -50,7 +50,7 @@ __always_inline uintptr_t make_syscall(int syscallno, uintptr_t arg0,
     asm volatile ("syscall"
             : "+a" (rax), "+D" (arg0), "+S" (arg1), "+d" (arg2)
             :
-            : "cc", "rcx", "r8", "r9", "r10", "r11");
+            : "cc", "memory", "rcx", "r8", "r9", "r10", "r11");
     return rax;
 }
 
@@ -62,7 +62,7 @@ __always_inline uintptr_t make_syscall(int syscallno, uintptr_t arg0,
     asm volatile ("syscall"
             : "+a" (rax), "+D" (arg0), "+S" (arg1), "+d" (arg2), "+r" (r10)
             :
-            : "cc", "rcx", "r8", "r9", "r11");
+            : "cc", "memory", "rcx", "r8", "r9", "r11");
     return rax;
 }
 
@@ -81,6 +81,25 @@ inline pid_t sys_getpid() {
     return make_syscall(SYSCALL_GETPID);
 }
 
+// vdso_getpid, vdso_ticks, vdso_hz, vdso_tsc_hz
+//    Read kernel data from the vDSO pages without a system call:
+//    the current process ID, the timer ticks since boot, the number of
+//    ticks per second, and the TSC frequency in Hz. (In `TICKLESS=1`
+//    kernels, the tick count is brought up to date only when the kernel
+//    runs, so it can lag by up to half a second.)
+inline pid_t vdso_getpid() {
+    return ((const vdso_proc_data*) VDSO_PROC_ADDR)->pid;
+}
+inline unsigned long vdso_ticks() {
+    return ((const vdso_data*) VDSO_ADDR)->ticks;
+}
+inline unsigned vdso_hz() {
+    return ((const vdso_data*) VDSO_ADDR)->hz;
+}
+inline unsigned long vdso_tsc_hz() {
+    return ((const vdso_data*) VDSO_ADDR)->tsc_hz;
+}
+
 // sys_yield
 //    Yield control of the CPU to the kernel. The kernel will pick another
 //    process to run, if possible.
@@ -100,6 +119,28 @@ inline int sys_page_alloc(void* addr) {
     return make_syscall(SYSCALL_PAGE_ALLOC, (uintptr_t) addr);
 }
 
+// sys_page_alloc_range(addr, npages, flags)
+//    Allocate `npages` zero-filled pages covering the virtual range that
+//    starts at `addr`, as if by calling `sys_page_alloc` on each page, but
+//    with one system call. `flags` may contain `PTE_W` to make the pages
+//    writable. Returns the number of pages mapped (fewer than `npages` if
+//    memory runs out), or -1 on invalid argument.
+inline int sys_page_alloc_range(void* addr, size_t npages, int flags) {
+    return make_syscall(SYSCALL_PAGE_ALLOC_RANGE, (uintptr_t) addr,
+                        npages, flags);
+}
+
+// sys_mmap(addr, sz, flags)
+//    Reserve the virtual range `[addr, addr + sz)` for demand paging. Each
+//    page in the range is allocated and zero-filled the first time it is
+//    touched, so untouched pages use no memory. `addr` must be page-aligned
+//    and >= PROC_START_ADDR, the range must end <= MEMSIZE_VIRTUAL, and no
+//    page in it may already be mapped. `flags` may contain `PTE_W` to make the pages writable. Returns 0 on
+//    success and -1 on failure.
+inline int sys_mmap(void* addr, size_t sz, int flags) {
+    return make_syscall(SYSCALL_MMAP, (uintptr_t) addr, sz, flags);
+}
+
 // sys_fork()
 //    Fork the current process. On success, return the child's process ID to
 //    the parent, and return 0 to the child. On failure, return -1.
@@ -107,6 +148,59 @@ inline pid_t sys_fork() {
     return make_syscall(SYSCALL_FORK);
 }
 
+// sys_sleep(ticks)
+//    Block for at least `ticks` timer ticks (a tick is 1/100 s). Returns 0.
+inline int sys_sleep(unsigned long ticks) {
+    return make_syscall(SYSCALL_SLEEP, ticks);
+}
+
+// sys_waitpid(pid)
+//    Block until process `pid` exits. Returns `pid`, or -1 if there is no
+//    such process (or `pid` is the caller).
+inline pid_t sys_waitpid(pid_t pid) {
+    return make_syscall(SYSCALL_WAITPID, pid);
+}
+
+// sys_exec(program_name)
+//    Replace this process's image with the built-in program
+//    `program_name`, keeping its process ID. Does not return on success;
+//    returns -1 if there is no such program. If memory runs out after the
+//    old image is gone, the process exits.
+inline int sys_exec(const char* program_name) {
+    return make_syscall(SYSCALL_EXEC, (uintptr_t) program_name);
+}
+
+// sys_shm_create(sz)
+//    Create a shared memory segment of `sz` bytes (rounded up to whole
+//    pages, at most 16 pages). Its pages are zero-filled. Returns the
+//    segment's ID, or -1 on failure. Segments last until reboot.
+inline int sys_shm_create(size_t sz) {
+    return make_syscall(SYSCALL_SHM_CREATE, sz);
+}
+
+// sys_shm_map(id, addr)
+//    Map shared memory segment `id`, writable, at page-aligned address
+//    `addr`. Every process that maps a segment sees the same physical
+//    pages, and children share their parent's mappings. The target range
+//    must be unmapped. Returns 0 on success and -1 on failure.
+inline int sys_shm_map(int id, void* addr) {
+    return make_syscall(SYSCALL_SHM_MAP, id, (uintptr_t) addr);
+}
+
+// sys_getstats(st)
+//    Copy the kernel's performance counters into `*st`. Returns 0 on
+//    success and -1 if `st` is not writable.
+inline int sys_getstats(kernel_stats* st) {
+    return make_syscall(SYSCALL_GETSTATS, (uintptr_t) st);
+}
+
+// sys_log(msg)
+//    Append the string `msg` to the kernel log (`log.txt` on the host).
+//    Messages longer than 127 bytes are truncated.
+inline void sys_log(const char* msg) {
+    make_syscall(SYSCALL_LOG, (uintptr_t) msg);
+}
+
 // sys_exit()
 //    Exit this process. Does not return.
 [[noreturn]] inline void sys_exit() {
@@ -128,4 +222,45 @@ inline pid_t sys_fork() {
     }
 }
 
+
+// spsc_ring<T, N>
+//    A single-producer, single-consumer ring of up to `N` values of type
+//    `T`, meant to live in a shared memory segment. One process may `push`
+//    while another `pop`s, with no locks and no system calls. An all-zero
+//    ring is empty, so a fresh segment needs no initialization. `N` must
+//    be a power of two.
+template <typename T, unsigned N>
+struct spsc_ring {
+    static_assert((N & (N - 1)) == 0, "spsc_ring size must be a power of 2");
+
+    // Append `x`. Returns false if the ring is full.
+    bool push(const T& x) {
+        unsigned t = __atomic_load_n(&tail_, __ATOMIC_RELAXED);
+        if (t - __atomic_load_n(&head_, __ATOMIC_ACQUIRE) == N) {
+            return false;
+        }
+        slots_[t % N] = x;
+        __atomic_store_n(&tail_, t + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    // Remove the oldest value into `x`. Returns false if the ring is empty.
+    bool pop(T& x) {
+        unsigned h = __atomic_load_n(&head_, __ATOMIC_RELAXED);
+        if (__atomic_load_n(&tail_, __ATOMIC_ACQUIRE) == h) {
+            return false;
+        }
+        x = slots_[h % N];
+        __atomic_store_n(&head_, h + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+  private:
+    // `head_` is written only by the consumer and `tail_` only by the
+    // producer; separate cache lines keep them from bouncing.
+    alignas(64) unsigned head_;
+    alignas(64) unsigned tail_;
+    alignas(64) T slots_[N];
+};
+
 #endif
@@ -179,6 +179,11 @@ typedef struct x86_64_msr_t {
 #define CR4_PCE                 0x00000100      // Perfmonitor Counter Enable
 #define CR4_OSFXSR              0x00000200      // OS FXSAVE/FXRSTOR support
 #define CR4_VMXE                0x00004000      // VMX Enable
+#define CR4_PCIDE               0x00020000      // PCID Enable
+
+// %cr3 flag bits (with CR4_PCIDE)
+#define CR3_PCIDMASK            0x0000000000000FFFUL // PCID of new page table
+#define CR3_NOFLUSH             0x8000000000000000UL // keep new PCID's TLB
 
 // eflags bits (useful for rdeflags() and wreflags())
 #define EFLAGS_CF               0x00000001      // Carry Flag